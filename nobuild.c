@@ -4,7 +4,7 @@
 #define CFLAGS "-Wall", "-Wextra"
 #define EXE "build/dragon"
 #define CC "clang++"
-#define SRC "src/dragon.cpp", "src/DragonConfig.cpp", "src/commands/build.cpp", "src/commands/clean.cpp", "src/commands/init.cpp", "src/commands/presets.cpp", "src/commands/run.cpp", "src/commands/package.cpp"
+#define SRC "src/dragon.cpp", "src/DragonConfig.cpp", "src/commands/build.cpp", "src/commands/clean.cpp", "src/commands/init.cpp", "src/commands/presets.cpp", "src/commands/run.cpp", "src/commands/package.cpp", "src/jobs.cpp", "src/hash.cpp", "src/commands/cache.cpp", "src/database.cpp", "src/process.cpp", "src/trace.cpp", "src/history.cpp", "src/commands/stats.cpp", "src/commands/watch.cpp", "src/commands/daemon.cpp", "src/scan.cpp", "src/todo.cpp", "src/targets.cpp", "src/elf.cpp"
 
 #ifndef _WIN32
 int main(int argc, char** argv) {
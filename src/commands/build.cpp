@@ -1,6 +1,6 @@
 #include "../dragon.hpp"
 
-std::string vecToString(std::vector<std::string>& vec) {
+std::string vecToString(const std::vector<std::string>& vec) {
     std::string ret = "";
     for (auto&& s : vec) {
         ret += s + " ";
@@ -8,11 +8,336 @@ std::string vecToString(std::vector<std::string>& vec) {
     return ret;
 }
 
-void build(std::vector<std::string>& cmd) {
-    run_with_args(cmd.front(), cmd);
+struct CompileJob {
+    std::string unit;
+    std::string outFile;
+    std::vector<std::string> command;
+    double estimate = 0;
+    uint64_t memory = 0;
+};
+
+// Orders jobs longest first so the slowest units do not start last and
+// leave the build waiting on them. Units without a recorded duration are
+// estimated from their source size using the ms per byte of the others,
+// units without a recorded peak memory get the average of the others.
+void schedule_jobs(std::vector<CompileJob>& jobs, BuildDatabase& db) {
+    std::vector<uint64_t> sizes(jobs.size(), 0);
+    uint64_t knownMs = 0;
+    uint64_t knownBytes = 0;
+    uint64_t knownMemory = 0;
+    size_t knownMemoryCount = 0;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        int64_t mtime;
+        file_stat(jobs[i].unit, sizes[i], mtime);
+        BuildRecord* record = db.find(jobs[i].outFile);
+        if (record && record->durationMs) {
+            jobs[i].estimate = record->durationMs;
+            knownMs += record->durationMs;
+            knownBytes += sizes[i];
+        }
+        if (record && record->peakMemory) {
+            jobs[i].memory = record->peakMemory;
+            knownMemory += record->peakMemory;
+            knownMemoryCount++;
+        }
+    }
+    double msPerByte = knownBytes ? (double) knownMs / knownBytes : 1.0;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        if (jobs[i].estimate == 0) {
+            jobs[i].estimate = sizes[i] * msPerByte;
+        }
+        if (jobs[i].memory == 0 && knownMemoryCount) {
+            jobs[i].memory = knownMemory / knownMemoryCount;
+        }
+    }
+    std::stable_sort(jobs.begin(), jobs.end(), [](const CompileJob& a, const CompileJob& b) {
+        return a.estimate > b.estimate;
+    });
+}
+
+int build(std::vector<std::string>& cmd, ProcessUsage* usage = nullptr) {
+    int ret = spawn_process(cmd, nullptr, SIZE_MAX, usage);
+    if (ret) {
+        DRAGON_ERR << "Error running " << cmd.front() << " (exit status " << ret << ")" << std::endl;
+    }
+    return ret;
+}
+
+// Replaces the changed members of an archive in place and deletes the ones
+// in removed, both without touching the symbol index. The index is rebuilt
+// once after all updates.
+int update_archive(const std::string& archiver, const std::string& archive, const std::vector<std::string>& changed, const std::vector<std::string>& removed, ProcessUsage* usage) {
+    std::vector<std::vector<std::string>> steps;
+    if (removed.size()) {
+        steps.push_back({archiver, "d", archive});
+        steps.back().insert(steps.back().end(), removed.begin(), removed.end());
+    }
+    if (changed.size()) {
+        steps.push_back({archiver, "rS", archive});
+        steps.back().insert(steps.back().end(), changed.begin(), changed.end());
+    }
+    steps.push_back({archiver, "s", archive});
+    for (auto&& step : steps) {
+        ProcessUsage stepUsage;
+        int ret = build(step, &stepUsage);
+        usage->cpuMs += stepUsage.cpuMs;
+        usage->peakMemory = std::max(usage->peakMemory, stepUsage.peakMemory);
+        if (ret) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+// Resolves a library name the way the linker would for the given search paths.
+// Returns an empty string for libraries that only exist in system locations.
+std::string find_library(const std::string& lib, const std::vector<std::string>& libDirs) {
+    if (lib.find(std::filesystem::path::preferred_separator) != std::string::npos) {
+        return std::filesystem::exists(lib) ? lib : "";
+    }
+    const char* patterns[] = {"lib%s.so", "lib%s.dylib", "lib%s.a", "%s.lib"};
+    for (auto&& dir : libDirs) {
+        for (auto&& pattern : patterns) {
+            std::string name = replaceAll(pattern, "%s", lib);
+            std::string path = dir + std::filesystem::path::preferred_separator + name;
+            if (std::filesystem::exists(path)) {
+                return path;
+            }
+        }
+    }
+    return "";
+}
+
+bool compiler_supports_depfiles(const std::string& compiler) {
+    std::string name = std::filesystem::path(compiler).filename().string();
+    return name.find("gcc") != std::string::npos ||
+           name.find("g++") != std::string::npos ||
+           name.find("clang") != std::string::npos ||
+           name == "cc" || name == "c++";
+}
+
+// "c" or "c++" for units a C or C++ source can include, empty for others
+// like Objective-C or assembly
+static std::string source_language(const std::string& unit) {
+    if (strendswith(unit, ".c")) {
+        return "c";
+    }
+    for (auto&& extension : {".cc", ".cpp", ".cxx", ".c++"}) {
+        if (strendswith(unit, extension)) {
+            return "c++";
+        }
+    }
+    return "";
+}
+
+// Groups C and C++ units by directory and language into batches of at most batchSize
+// units and writes one source per batch into unityDir that includes them.
+// Sources are only rewritten when their content changes, so the batches of
+// untouched directories keep their timestamps. Returns the batch sources.
+std::vector<std::string> write_unity_sources(const std::vector<std::string>& units, size_t sourceDirPrefixLen, size_t batchSize, const std::string& unityDir) {
+    std::map<std::string, std::vector<std::string>> groups;
+    for (auto&& unit : units) {
+        std::string relative = unit.substr(sourceDirPrefixLen);
+        size_t slash = relative.find_last_of(std::filesystem::path::preferred_separator);
+        std::string dir = slash == std::string::npos ? "" : relative.substr(0, slash + 1);
+        std::replace(dir.begin(), dir.end(), '/', '@');
+        groups[dir + (source_language(unit) == "c" ? "unity-%.c" : "unity-%.cpp")].push_back(unit);
+    }
+
+    std::filesystem::create_directories(unityDir);
+    std::vector<std::string> sources;
+    for (auto&& group : groups) {
+        std::vector<std::string>& members = group.second;
+        std::sort(members.begin(), members.end());
+        for (size_t first = 0, batch = 0; first < members.size(); first += batchSize, batch++) {
+            std::string content = "// Generated by Dragon, do not edit\n";
+            for (size_t i = first; i < members.size() && i < first + batchSize; i++) {
+                content += "#include \"" + std::filesystem::absolute(members[i]).string() + "\"\n";
+            }
+            std::string source = unityDir + std::filesystem::path::preferred_separator + replaceAll(group.first, "%", std::to_string(batch));
+
+            std::ifstream existing(source, std::ios::binary);
+            std::string previous((std::istreambuf_iterator<char>(existing)), std::istreambuf_iterator<char>());
+            if (!existing || previous != content) {
+                std::ofstream out(source, std::ios::binary);
+                out << content;
+            }
+            sources.push_back(source);
+        }
+    }
+
+    // batches that no longer exist would otherwise linger forever
+    std::error_code ec;
+    for (auto& entry : std::filesystem::directory_iterator(unityDir, ec)) {
+        if (std::find(sources.begin(), sources.end(), entry.path().string()) == sources.end()) {
+            std::filesystem::remove(entry.path(), ec);
+        }
+    }
+    return sources;
 }
 
-std::string build_from_config(DragonConfig::CompoundEntry* buildConfig) {
+bool compiler_is_clang(const std::string& compiler) {
+    std::string name = std::filesystem::path(compiler).filename().string();
+    if (name.find("clang") != std::string::npos) {
+        return true;
+    }
+    if (name.find("gcc") != std::string::npos || name.find("g++") != std::string::npos) {
+        return false;
+    }
+    // cc and c++ can be either, asked once per compiler like compiler_identity
+    static std::mutex lock;
+    static std::map<std::string, bool> known;
+    std::lock_guard<std::mutex> guard(lock);
+    auto probed = known.find(compiler);
+    if (probed != known.end()) {
+        return probed->second;
+    }
+    std::string version;
+    spawn_process({compiler, "--version"}, &version, 4096);
+    return known[compiler] = version.find("clang") != std::string::npos;
+}
+
+// Parses a Makefile style depfile as written by -MMD -MF
+std::vector<std::string> parse_depfile(const std::string& path) {
+    std::vector<std::string> deps;
+    std::ifstream file(path);
+    if (!file) {
+        return deps;
+    }
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    std::string data = buffer.str();
+
+    size_t i = 0;
+    // skip the rule target, 'C:\' style drive letters are not separators
+    for (; i < data.size(); i++) {
+        if (data[i] == ':' && (i + 1 >= data.size() || isspace(data[i + 1]))) {
+            i++;
+            break;
+        }
+    }
+    std::string current;
+    for (; i < data.size(); i++) {
+        char c = data[i];
+        if (c == '\\' && i + 1 < data.size()) {
+            char next = data[i + 1];
+            if (next == '\n' || next == '\r') {
+                i++;
+                continue;
+            }
+            if (next == ' ' || next == '#') {
+                current += next;
+                i++;
+                continue;
+            }
+        } else if (c == '$' && i + 1 < data.size() && data[i + 1] == '$') {
+            current += '$';
+            i++;
+            continue;
+        }
+        if (isspace(c)) {
+            if (current.size()) {
+                deps.push_back(current);
+                current.clear();
+            }
+            continue;
+        }
+        current += c;
+    }
+    if (current.size()) {
+        deps.push_back(current);
+    }
+    return deps;
+}
+
+std::atomic<bool> buildCancelled{false};
+
+#define TODO_SCAN_TRACK 10000
+
+// Resolves the 'units' list. Entries are applied in order: plain paths are
+// taken as they are, globs add every matching file below sourceDir and
+// entries starting with '!' remove whatever they match from the units so far.
+static bool expand_units(DragonConfig::CompoundEntry* buildConfig, std::vector<std::string>& units) {
+    DragonConfig::ListEntry* entries = buildConfig->getList("units");
+    bool globbed = false;
+    for (u_long i = 0; i < entries->size(); i++) {
+        globbed |= is_glob(entries->getString(i)->getValue());
+    }
+    if (!globbed) {
+        for (u_long i = 0; i < entries->size(); i++) {
+            units.push_back(entries->getString(i)->getValue());
+        }
+        return true;
+    }
+
+    TraceSpan span("unit glob", "scan");
+    auto start = std::chrono::steady_clock::now();
+    std::string sourceDir = buildConfig->getStringOrDefault("sourceDir", "src")->getValue();
+    std::filesystem::path outputPath = std::filesystem::path(buildConfig->getStringOrDefault("outputDir", "build")->getValue()).lexically_normal();
+    std::string snapshotFile =
+        buildConfig->getStringOrDefault("outputDir", "build")->getValue() +
+        std::filesystem::path::preferred_separator +
+        "build.drg.units";
+
+    DirectorySnapshot snapshot;
+    snapshot.load(snapshotFile);
+    size_t relisted;
+    {
+        JobPool pool(jobs ? jobs : default_job_count());
+        relisted = snapshot.refresh(sourceDir, pool, [&outputPath](const std::string& dir) {
+            return std::filesystem::path(dir).lexically_normal() == outputPath;
+        });
+    }
+    if (relisted && !snapshot.save(snapshotFile)) {
+        DRAGON_ERR << "Failed to write " << snapshotFile << std::endl;
+    }
+    std::vector<std::string> files = snapshot.files();
+
+    std::set<std::string> seen;
+    for (u_long i = 0; i < entries->size(); i++) {
+        std::string entry = entries->getString(i)->getValue();
+        if (strstarts(entry, "!")) {
+            std::string pattern = entry.substr(1);
+            units.erase(std::remove_if(units.begin(), units.end(), [&](const std::string& unit) {
+                if (glob_match(pattern, unit)) {
+                    seen.erase(unit);
+                    return true;
+                }
+                return false;
+            }), units.end());
+        } else if (is_glob(entry)) {
+            for (auto&& file : files) {
+                if (glob_match(entry, file) && seen.insert(file).second) {
+                    units.push_back(file);
+                }
+            }
+        } else if (seen.insert(entry).second) {
+            units.push_back(entry);
+        }
+    }
+
+    uint64_t elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    span.arg("directories", std::to_string(snapshot.dirs.size()));
+    span.arg("relisted", std::to_string(relisted));
+    span.arg("units", std::to_string(units.size()));
+    DRAGON_LOG << "Expanded units to " << units.size() << " file(s) in " << elapsed << " ms, " << relisted << " of " << snapshot.dirs.size() << " directories listed" << std::endl;
+    if (units.empty()) {
+        DRAGON_ERR << "No compilation units matched!" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+std::string build_from_config(DragonConfig::CompoundEntry* buildConfig, BuildDatabase* session, BuildTarget* buildTarget) {
+    if (!buildTarget && buildConfig->getCompound("targets")) {
+        return build_targets(buildConfig);
+    }
+    TargetTurn turn(buildTarget);
+    // starts out as the -fullRebuild option, watch pattern and config changes
+    // only force a full rebuild of this build, not of later ones in the same
+    // process (cmd_watch, the build server)
+    bool rebuildAll = fullRebuild;
+
     if (!buildConfig->getList("units") || buildConfig->getList("units")->size() == 0) {
         DRAGON_ERR << "No compilation units defined!" << std::endl;
         return "";
@@ -53,6 +378,16 @@ std::string build_from_config(DragonConfig::CompoundEntry* buildConfig) {
         return "";
     }
 
+    std::string targetType = buildConfig->getStringOrDefault("type", "exe")->getValue();
+    if (targetType != "exe" && targetType != "static" && targetType != "shared") {
+        DRAGON_ERR << "Unknown target type: " << targetType << std::endl;
+        return "";
+    }
+    if (targetType == "static" && !incrementalBuild) {
+        DRAGON_ERR << "Static libraries require incremental build!" << std::endl;
+        return "";
+    }
+
     std::vector<std::string> cmd;
     cmd.push_back(buildConfig->getStringOrDefault("compiler", "clang")->getValue());
     if (buildConfig->getList("flags")) {
@@ -85,20 +420,6 @@ std::string build_from_config(DragonConfig::CompoundEntry* buildConfig) {
             );
         }
     }
-    if (buildConfig->getList("libraryPaths")) {
-        for (u_long i = 0; i < buildConfig->getList("libraryPaths")->size(); i++) {
-            cmd.push_back(
-                buildConfig->getStringOrDefault("libraryPathPrefix", "-L")->getValue() +
-                buildConfig->getList("libraryPaths")->getString(i)->getValue()
-            );
-        }
-    }
-    for (auto libDir : customLibraryPaths) {
-        cmd.push_back(
-            buildConfig->getStringOrDefault("libraryPathPrefix", "-L")->getValue() +
-            libDir
-        );
-    }
     if (buildConfig->getList("includes")) {
         for (u_long i = 0; i < buildConfig->getList("includes")->size(); i++) {
             if (buildConfig->getStringOrDefault("includePrefix", "-I")->getValue() == DRAGON_UNSUPPORTED_STR) {
@@ -135,17 +456,90 @@ std::string build_from_config(DragonConfig::CompoundEntry* buildConfig) {
         );
     }
 
+#if !defined(_WIN32)
+    if (targetType == "shared" || (targetType == "static" && buildTarget && buildTarget->linkedIntoShared())) {
+        cmd.push_back("-fPIC");
+    }
+#endif
+
+    std::string lto = buildConfig->getStringOrDefault("lto", "")->getValue();
+    // only probed when it matters, cc and c++ spawn the compiler for it
+    bool ltoClang = lto.size() && compiler_is_clang(buildConfig->getStringOrDefault("compiler", "clang")->getValue());
+    if (lto.size() && lto != "thin" && lto != "full") {
+        DRAGON_ERR << "Unknown lto mode: " << lto << std::endl;
+        return "";
+    }
+    if (lto == "thin") {
+        cmd.push_back(ltoClang ? "-flto=thin" : "-flto");
+    } else if (lto == "full") {
+        cmd.push_back("-flto");
+    }
+
+    // everything below only matters to the link
+    std::vector<std::string> compileCmd(cmd);
+
+    // the link runs the code generation, spread over the build's jobs. The
+    // job count is left out of the link command hash, so a different -j does
+    // not relink
+    std::vector<std::string> ltoJobFlags;
+    if (lto.size()) {
+        std::string ltoJobs = std::to_string(jobs ? jobs : default_job_count());
+        if (!ltoClang) {
+            // gcc has no thin mode, both partition the program with its
+            // default balanced partitioning and compile the partitions in parallel
+            ltoJobFlags.push_back("-flto=" + ltoJobs);
+        } else if (lto == "thin") {
+            ltoJobFlags.push_back("-flto-jobs=" + ltoJobs);
+            // unchanged modules are taken from the cache on incremental links
+            std::string ltoCache = buildConfig->getStringOrDefault("outputDir", "build")->getValue() + std::filesystem::path::preferred_separator + "lto-cache";
+#if defined(__APPLE__)
+            cmd.push_back("-Wl,-cache_path_lto," + ltoCache);
+#else
+            // the cache option depends on the linker, lld is used when the
+            // flags pick it or pick none and ld.lld is installed
+            std::string linker;
+            for (auto&& flag : cmd) {
+                if (strstarts(flag, "-fuse-ld=")) {
+                    linker = flag.substr(9);
+                }
+            }
+            bool lld = linker == "lld" || strendswith(linker, "ld.lld");
+            if (linker.empty() && find_program("ld.lld").size()) {
+                cmd.push_back("-fuse-ld=lld");
+                lld = true;
+            }
+            if (lld) {
+                cmd.push_back("-Wl,--thinlto-cache-dir=" + ltoCache);
+            } else if (linker == "gold" || strendswith(linker, "ld.gold")) {
+                cmd.push_back("-Wl,-plugin-opt,cache-dir=" + ltoCache);
+            } else {
+                DRAGON_LOG << "Linking without a ThinLTO cache, " << (linker.empty() ? "ld.lld is not installed" : "it needs lld or gold, not " + linker) << std::endl;
+            }
+#endif
+        }
+    }
+
+    if (buildConfig->getList("libraryPaths")) {
+        for (u_long i = 0; i < buildConfig->getList("libraryPaths")->size(); i++) {
+            cmd.push_back(
+                buildConfig->getStringOrDefault("libraryPathPrefix", "-L")->getValue() +
+                buildConfig->getList("libraryPaths")->getString(i)->getValue()
+            );
+        }
+    }
+    for (auto libDir : customLibraryPaths) {
+        cmd.push_back(
+            buildConfig->getStringOrDefault("libraryPathPrefix", "-L")->getValue() +
+            libDir
+        );
+    }
+
     bool outDirExists = std::filesystem::exists(buildConfig->getStringOrDefault("outputDir", "build")->getValue());
     if (outDirExists) {
         if (buildConfig->getStringOrDefault("outputDir", "build")->getValue() == ".") {
             DRAGON_ERR << "Cannot build in current directory" << std::endl;
             return "";
         }
-        std::filesystem::remove_all(
-            buildConfig->getStringOrDefault("outputDir", "build")->getValue() +
-            std::filesystem::path::preferred_separator +
-            buildConfig->getStringOrDefault("target", "main")->getValue()
-        );
     }
     try {
         std::filesystem::create_directories(buildConfig->getStringOrDefault("outputDir", "build")->getValue());
@@ -160,18 +554,13 @@ std::string build_from_config(DragonConfig::CompoundEntry* buildConfig) {
         return "";
     }
 
-#if defined(_WIN32)
-#define PRE_BUILD_TAG "preBuildWin"
-#define POST_BUILD_TAG "postBuildWin"
-#else
-#define PRE_BUILD_TAG "preBuild"
-#define POST_BUILD_TAG "postBuild"
-#endif
-
     if (buildConfig->getList(PRE_BUILD_TAG)) {
         for (u_long i = 0; i < buildConfig->getList(PRE_BUILD_TAG)->size(); i++) {
             DRAGON_LOG << "Running prebuild command: " << buildConfig->getList(PRE_BUILD_TAG)->getString(i)->getValue() << std::endl;
-            int ret = system(buildConfig->getList(PRE_BUILD_TAG)->getString(i)->getValue().c_str());
+            TraceSpan span("preBuild", "command");
+            span.arg("command", buildConfig->getList(PRE_BUILD_TAG)->getString(i)->getValue());
+            int ret = run_command(buildConfig->getList(PRE_BUILD_TAG)->getString(i)->getValue());
+            span.arg("exit status", std::to_string(ret));
             if (ret != 0) {
                 DRAGON_ERR << "Pre-build command failed: " << buildConfig->getList(PRE_BUILD_TAG)->getString(i)->getValue() << std::endl;
                 return "";
@@ -183,23 +572,23 @@ std::string build_from_config(DragonConfig::CompoundEntry* buildConfig) {
     std::vector<std::string> units;
     units.reserve(unitSize);
 
-    if (buildConfig->getList("units")) {
-        for (u_long i = 0; i < buildConfig->getList("units")->size(); i++) {
-            std::string unit = buildConfig->getList("units")->getString(i)->getValue();
-            
-            if (!incrementalBuild) {
-                cmd.push_back(
-                    buildConfig->getStringOrDefault("sourceDir", "src")->getValue() +
-                    std::filesystem::path::preferred_separator +
-                    unit
-                );
-            }
-            units.push_back(
+    std::vector<std::string> configUnits;
+    if (!expand_units(buildConfig, configUnits)) {
+        return "";
+    }
+    for (auto&& unit : configUnits) {
+        if (!incrementalBuild) {
+            cmd.push_back(
                 buildConfig->getStringOrDefault("sourceDir", "src")->getValue() +
                 std::filesystem::path::preferred_separator +
                 unit
             );
         }
+        units.push_back(
+            buildConfig->getStringOrDefault("sourceDir", "src")->getValue() +
+            std::filesystem::path::preferred_separator +
+            unit
+        );
     }
 
     for (size_t i = 0; i < unitSize; i++) {
@@ -237,8 +626,6 @@ std::string build_from_config(DragonConfig::CompoundEntry* buildConfig) {
     size_t sourceDirPrefixLen =
         (buildConfig->getStringOrDefault("sourceDir", "src")->getValue() + std::filesystem::path::preferred_separator).size();
 
-    std::vector<std::thread> threads;
-
     std::string cachedBuildConfig =
         buildConfig->getStringOrDefault("outputDir", "build")->getValue() +
         std::filesystem::path::preferred_separator +
@@ -256,7 +643,7 @@ std::string build_from_config(DragonConfig::CompoundEntry* buildConfig) {
     if (file_modified_time(cachedBuildConfig) < file_modified_time(buildConfigFile)) {
         bool fullRebuildOnConfigChange = buildConfig->getStringOrDefault("fullRebuildOnConfigChange", "false")->getValue() == "true";
         if (fullRebuildOnConfigChange) {
-            fullRebuild = true;
+            rebuildAll = true;
         }
         cacheConfig();
     }
@@ -269,114 +656,713 @@ std::string build_from_config(DragonConfig::CompoundEntry* buildConfig) {
     };
 
     DragonConfig::ListEntry* watchRegexes = buildConfig->getList("watch");
-    if (watchRegexes) {
-        std::filesystem::path sourcePath(buildConfig->getStringOrDefault("sourceDir", "src")->getValue());
-        // recurse through source directory
-        for (auto& p : std::filesystem::recursive_directory_iterator(sourcePath)) {
-            if (std::filesystem::is_regular_file(p)) {
-                std::string path = p.path().string();
-                for (u_long i = 0; i < watchRegexes->size(); i++) {
-                    std::regex regex(watchRegexes->getString(i)->getValue());
-                    if (std::regex_search(path, regex)) {
-                        std::string cachedFile =
-                            buildConfig->getStringOrDefault("outputDir", "build")->getValue() +
-                            std::filesystem::path::preferred_separator +
-                            replaceAll(path.substr(sourceDirPrefixLen), "/", "@");
-                        
-                        if (!std::filesystem::exists(cachedFile)) {
-                            cacheFile(path, cachedFile);
-                        } else {
-                            if (file_modified_time(cachedFile) < file_modified_time(path)) {
-                                fullRebuild = true;
-                                cacheFile(path, cachedFile);
-                            }
-                        }
+    if (watchRegexes && watchRegexes->size()) {
+        TraceSpan span("watch scan", "scan");
+        auto start = std::chrono::steady_clock::now();
+
+        // all patterns are compiled once into a single alternation
+        std::string pattern;
+        for (u_long i = 0; i < watchRegexes->size(); i++) {
+            pattern += (i ? "|(?:" : "(?:") + watchRegexes->getString(i)->getValue() + ")";
+        }
+        std::regex matcher;
+        try {
+            matcher = std::regex(pattern, std::regex::ECMAScript | std::regex::optimize | std::regex::nosubs);
+        } catch (std::regex_error& e) {
+            DRAGON_ERR << "Invalid watch pattern: " << e.what() << std::endl;
+            return "";
+        }
+
+        std::vector<std::filesystem::path> pruned;
+        pruned.push_back(std::filesystem::path(buildConfig->getStringOrDefault("outputDir", "build")->getValue()).lexically_normal());
+        if (buildConfig->getList("watchPrune")) {
+            for (u_long i = 0; i < buildConfig->getList("watchPrune")->size(); i++) {
+                pruned.push_back((std::filesystem::path(buildConfig->getStringOrDefault("sourceDir", "src")->getValue()) / buildConfig->getList("watchPrune")->getString(i)->getValue()).lexically_normal());
+            }
+        }
+
+        std::mutex matchLock;
+        std::vector<std::string> matches;
+        std::atomic<size_t> scanned{0};
+        {
+            JobPool pool(jobs ? jobs : default_job_count());
+            scan_directory(
+                buildConfig->getStringOrDefault("sourceDir", "src")->getValue(),
+                pool,
+                [&pruned](const std::string& dir) {
+                    return std::find(pruned.begin(), pruned.end(), std::filesystem::path(dir).lexically_normal()) != pruned.end();
+                },
+                [&](const std::string& path) {
+                    scanned++;
+                    if (std::regex_search(path, matcher)) {
+                        std::lock_guard<std::mutex> guard(matchLock);
+                        matches.push_back(path);
                     }
                 }
+            );
+        }
+
+        for (auto&& path : matches) {
+            std::string cachedFile =
+                buildConfig->getStringOrDefault("outputDir", "build")->getValue() +
+                std::filesystem::path::preferred_separator +
+                replaceAll(path.substr(sourceDirPrefixLen), "/", "@");
+
+            if (!std::filesystem::exists(cachedFile)) {
+                cacheFile(path, cachedFile);
+            } else {
+                if (file_modified_time(cachedFile) < file_modified_time(path)) {
+                    rebuildAll = true;
+                    cacheFile(path, cachedFile);
+                }
             }
         }
+        uint64_t elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        span.arg("files", std::to_string(scanned));
+        span.arg("matches", std::to_string(matches.size()));
+        DRAGON_LOG << "Scanned " << scanned << " file(s) for watch patterns in " << elapsed << " ms, " << matches.size() << " matched" << std::endl;
     }
 
-    for (auto&& unit : units) {
-        FILE* file = fopen(unit.c_str(), "r");
-        size_t len = 1024;
-        char* cline = new char[1025];
-        ssize_t l;
-        while ((l = getline(&cline, &len, file)) != EOF) {
-            std::string line(cline, len);
-            size_t n;
-                                // this string is like this because otherwise
-                                // it would be picked up by this here
-            if ((n = line.find("// ""TODO")) != std::string::npos) {
-                DRAGON_LOG << "Todo: " << line.substr(line.find("TODO") + 5) << std::endl;
+    std::string compilerName = buildConfig->getStringOrDefault("compiler", "clang")->getValue();
+    bool trackDependencies = buildConfig->getStringOrDefault("dependencyTracking", compiler_supports_depfiles(compilerName) ? "true" : "false")->getValue() == "true";
+
+    std::string rebuildPolicy = buildConfig->getStringOrDefault("rebuildPolicy", "mtime")->getValue();
+    if (rebuildPolicy != "mtime" && rebuildPolicy != "hash") {
+        DRAGON_ERR << "Unknown rebuild policy: " << rebuildPolicy << std::endl;
+        return "";
+    }
+    bool hashPolicy = rebuildPolicy == "hash";
+
+    std::string databaseFile =
+        buildConfig->getStringOrDefault("outputDir", "build")->getValue() +
+        std::filesystem::path::preferred_separator +
+        "build.drg.db";
+
+    BuildDatabase localDb;
+    BuildDatabase& db = session ? *session : localDb;
+    if ((!session || (db.records.empty() && db.files.files.empty())) && std::filesystem::exists(databaseFile)) {
+        db.load(databaseFile);
+    }
+    FileHashCache& hashCache = db.files;
+
+    auto unitInputs = [](const std::string& unit, const std::vector<std::string>& deps) {
+        std::vector<std::string> inputs;
+        inputs.push_back(unit);
+        for (auto&& dep : deps) {
+            if (dep != unit) {
+                inputs.push_back(dep);
+            }
+        }
+        return inputs;
+    };
+
+    // a record without dependencies was written while tracking was off
+    auto recordUsable = [trackDependencies](BuildRecord* record) {
+        return record && record->exitStatus == 0 && (!trackDependencies || record->deps.size());
+    };
+
+    auto contentChanged = [&](const std::string& unit, const std::string& outFile) {
+        BuildRecord* record = db.find(outFile);
+        if (!recordUsable(record)) {
+            return true;
+        }
+        uint64_t digest;
+        if (!hashCache.digestAll(unitInputs(unit, record->deps), digest)) {
+            return true;
+        }
+        return digest != record->inputDigest;
+    };
+
+    std::unique_ptr<ObjectCache> objectCache;
+    if (incrementalBuild && buildConfig->getStringOrDefault("objectCache", "false")->getValue() == "true") {
+        if (trackDependencies) {
+            objectCache = std::make_unique<ObjectCache>(
+                buildConfig->getStringOrDefault("cacheDir", default_cache_dir())->getValue(),
+                parse_size(buildConfig->getStringOrDefault("cacheMaxSize", DRAGON_CACHE_MAX_SIZE)->getValue())
+            );
+        } else {
+            DRAGON_ERR << "Object cache requires dependency tracking, not using it" << std::endl;
+        }
+    }
+    // the cache statistics are written however the build ends
+    struct ObjectCacheFlush {
+        ObjectCache* cache;
+        ~ObjectCacheFlush() {
+            if (this->cache) {
+                this->cache->flush();
+            }
+        }
+    } objectCacheFlush{objectCache.get()};
+
+    // headers are shared between many units, only stat each of them once
+    std::map<std::string, int64_t> fileTimes;
+    auto modifiedTime = [&fileTimes](const std::string& path, int64_t& mtime) {
+        auto known = fileTimes.find(path);
+        if (known != fileTimes.end()) {
+            mtime = known->second;
+            return mtime >= 0;
+        }
+        uint64_t size;
+        if (!file_stat(path, size, mtime)) {
+            mtime = -1;
+        }
+        fileTimes[path] = mtime;
+        return mtime >= 0;
+    };
+    auto dependenciesChanged = [&](BuildRecord* record, int64_t outTime) {
+        if (!recordUsable(record)) {
+            return true;
+        }
+        for (auto&& dep : record->deps) {
+            int64_t depTime;
+            if (!modifiedTime(dep, depTime) || outTime < depTime) {
+                return true;
             }
         }
+        return false;
+    };
+
+    std::string outDir = buildConfig->getStringOrDefault("outputDir", "build")->getValue();
+    std::string unityDir = outDir + std::filesystem::path::preferred_separator + "unity";
+    // set once the pch flags are known, objects of targets are named after
+    // their unit and compile flags so that identical compiles share one
+    uint64_t objectFlagsHash = 0;
+    auto objectFile = [&](const std::string& unit) {
+        std::string name = strstarts(unit, unityDir) ? "unity" + unit.substr(unityDir.size()) : unit.substr(sourceDirPrefixLen);
+        std::replace(name.begin(), name.end(), '/', '@');
+        if (buildTarget && !strstarts(unit, unityDir)) {
+            return buildTarget->graph->objectDir + std::filesystem::path::preferred_separator + name + "-" + hash_to_string(hash_string(unit, objectFlagsHash)) + ".o";
+        }
+        return outDir + std::filesystem::path::preferred_separator + name + ".o";
+    };
 
+    // units compiled on their own, in unity mode most of them are replaced
+    // by batch sources including them
+    std::vector<std::string> compileUnits(units);
+    if (buildConfig->getStringOrDefault("unityBuild", "false")->getValue() == "true") {
         if (!incrementalBuild) {
+            DRAGON_ERR << "Unity build requires incremental build, not using it" << std::endl;
+        } else if (!trackDependencies) {
+            DRAGON_ERR << "Unity build requires dependency tracking, not using it" << std::endl;
+        } else {
+            size_t batchSize = std::strtoul(buildConfig->getStringOrDefault("unityBatchSize", "16")->getValue().c_str(), nullptr, 10);
+            std::vector<std::string> excluded;
+            if (buildConfig->getList("unityExclude")) {
+                for (u_long i = 0; i < buildConfig->getList("unityExclude")->size(); i++) {
+                    excluded.push_back(buildConfig->getList("unityExclude")->getString(i)->getValue());
+                }
+            }
+            // other languages cannot be included in a batch and are compiled on their own
+            std::vector<std::string> batched;
+            compileUnits.clear();
+            for (auto&& unit : units) {
+                if (source_language(unit).empty() || std::find(excluded.begin(), excluded.end(), unit.substr(sourceDirPrefixLen)) != excluded.end()) {
+                    compileUnits.push_back(unit);
+                } else {
+                    batched.push_back(unit);
+                }
+            }
+            std::vector<std::string> sources = write_unity_sources(batched, sourceDirPrefixLen, batchSize ? batchSize : 1, unityDir);
+            compileUnits.insert(compileUnits.end(), sources.begin(), sources.end());
+            DRAGON_LOG << "Unity build: " << batched.size() << " unit(s) in " << sources.size() << " batch(es), " << compileUnits.size() - sources.size() << " on their own" << std::endl;
+        }
+    }
+
+    size_t outputLimit = parse_size(buildConfig->getStringOrDefault("maxJobOutput", DRAGON_JOB_OUTPUT_LIMIT)->getValue());
+
+    auto needsBuild = [&](const std::string& source, const std::string& outFile, const std::vector<std::string>& command) {
+        BuildRecord* record = db.find(outFile);
+        int64_t outTime;
+        if (rebuildAll || !record || record->commandHash != hash_string(vecToString(command)) || !modifiedTime(outFile, outTime)) {
+            return true;
+        }
+        if (hashPolicy) {
+            return contentChanged(source, outFile);
+        }
+        int64_t sourceTime;
+        return !modifiedTime(source, sourceTime) || outTime <= sourceTime || (trackDependencies && dependenciesChanged(record, outTime));
+    };
+
+    // the precompiled header is built once per set of compile flags and per
+    // language of the units, which pick it up through -include (gcc) or
+    // -include-pch (clang). Units in other languages do not use it.
+    auto pchLanguage = [](const std::string& unit) { return source_language(unit).empty() ? "" : source_language(unit) + "-header"; };
+    std::map<std::string, std::vector<std::string>> pchFlags;
+    std::set<std::string> pchRebuilt;
+    uint64_t pchDigest = 0;
+    std::string pchHeader = buildConfig->getStringOrDefault("pch", "")->getValue();
+    if (pchHeader.size() && !incrementalBuild) {
+        DRAGON_ERR << "Precompiled headers require incremental build, not using " << pchHeader << std::endl;
+    } else if (pchHeader.size()) {
+        std::set<std::string> languages;
+        for (auto&& unit : compileUnits) {
+            if (pchLanguage(unit).size()) {
+                languages.insert(pchLanguage(unit));
+            }
+        }
+        for (auto&& language : languages) {
+            std::string source =
+                buildConfig->getStringOrDefault("sourceDir", "src")->getValue() +
+                std::filesystem::path::preferred_separator +
+                pchHeader;
+            std::string name = pchHeader;
+            std::replace(name.begin(), name.end(), '/', '@');
+            std::string pchDir = outDir + std::filesystem::path::preferred_separator + "pch";
+            std::string base = pchDir + std::filesystem::path::preferred_separator + name + "-" + hash_to_string(hash_string(vecToString(compileCmd) + " " + language));
+            bool clang = compiler_is_clang(compilerName);
+            std::string pchFile = base + (clang ? ".pch" : ".gch");
+
+            std::vector<std::string> pchCmd(compileCmd);
+            pchCmd.push_back("-x");
+            pchCmd.push_back(language);
+            pchCmd.push_back(source);
+            pchCmd.push_back("-o");
+            pchCmd.push_back(pchFile);
+            if (trackDependencies) {
+                pchCmd.push_back("-MMD");
+                pchCmd.push_back("-MF");
+                pchCmd.push_back(pchFile + ".d");
+            }
+
+            if (needsBuild(source, pchFile, pchCmd)) {
+                TraceSpan span(pchHeader, "pch");
+                span.arg("command", vecToString(pchCmd));
+                std::filesystem::create_directories(pchDir);
+                DRAGON_LOG << "Building precompiled header: " << pchFile << std::endl;
+
+                BuildRecord record;
+                std::string diagnostics;
+                auto start = std::chrono::steady_clock::now();
+                record.exitStatus = spawn_process(pchCmd, &diagnostics, outputLimit);
+                record.durationMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+                span.arg("exit status", std::to_string(record.exitStatus));
+                if (record.exitStatus) {
+                    std::filesystem::remove(pchFile + ".d");
+                    db.record(pchFile, record);
+                    db.save(databaseFile);
+                    emit_job_output("", diagnostics + "[Dragon] Error building " + pchFile + " (exit status " + std::to_string(record.exitStatus) + ")\n");
+                    DRAGON_ERR << "Build failed!" << std::endl;
+                    return "";
+                }
+                emit_job_output("", diagnostics);
+                if (trackDependencies) {
+                    record.deps = parse_depfile(pchFile + ".d");
+                    std::filesystem::remove(pchFile + ".d");
+                }
+                record.commandHash = hash_string(vecToString(pchCmd));
+                if (hashPolicy) {
+                    hashCache.digestAll(unitInputs(source, record.deps), record.inputDigest);
+                }
+                db.record(pchFile, record);
+                pchRebuilt.insert(language);
+            }
+            if (objectCache) {
+                BuildRecord* record = db.find(pchFile);
+                hashCache.digestAll(unitInputs(source, record ? record->deps : std::vector<std::string>()), pchDigest);
+            }
+            if (clang) {
+                pchFlags[language] = {"-include-pch", pchFile};
+            } else {
+                pchFlags[language] = {"-include", base};
+            }
+        }
+    }
+
+    objectFlagsHash = hash_string(vecToString(compileCmd));
+    for (auto&& flags : pchFlags) {
+        objectFlagsHash = hash_string(vecToString(flags.second), objectFlagsHash);
+    }
+
+    std::vector<CompileJob> compileJobs;
+
+    TraceSpan checkSpan("check units", "scan");
+    for (auto&& unit : compileUnits) {
+        if (!incrementalBuild) {
+            break;
+        }
+
+        std::string outFile = objectFile(unit);
+
+        std::vector<std::string> tmp(compileCmd);
+
+        std::vector<std::string>& unitPch = pchFlags[pchLanguage(unit)];
+        tmp.insert(tmp.end(), unitPch.begin(), unitPch.end());
+        tmp.push_back(unit);
+        tmp.push_back("-o");
+        tmp.push_back(outFile);
+        tmp.push_back("-c");
+        if (trackDependencies) {
+            tmp.push_back("-MMD");
+            tmp.push_back("-MF");
+            tmp.push_back(outFile + ".d");
+        }
+
+        if (!pchRebuilt.count(pchLanguage(unit)) && !needsBuild(unit, outFile, tmp)) {
             continue;
         }
 
-        std::string outFile =
-            buildConfig->getStringOrDefault("outputDir", "build")->getValue() +
-            std::filesystem::path::preferred_separator +
-            replaceAll(unit.substr(sourceDirPrefixLen), "/", "@") +
-            ".o";
+        compileJobs.push_back(CompileJob{unit, outFile, tmp, 0});
+    }
+    checkSpan.arg("units", std::to_string(compileUnits.size()));
+    checkSpan.arg("stale", std::to_string(compileJobs.size()));
+    checkSpan.end();
 
-        auto tmp = new std::vector(cmd);
+    // todos are reported while the units compile, the link waits for the scan
+    bool scanTodos = buildConfig->getStringOrDefault("scanTodos", "false")->getValue() == "true";
+    std::string todoFile = outDir + std::filesystem::path::preferred_separator + "build.drg.todos";
+    TodoCache todoCache;
+    std::thread todoScanner;
+    if (scanTodos) {
+        todoCache.load(todoFile);
+        trace_name_track(TODO_SCAN_TRACK, "todo scan");
+        todoScanner = std::thread([&]() {
+            TraceSpan span("todo scan", "scan", TODO_SCAN_TRACK);
+            for (auto&& unit : units) {
+                std::vector<std::string> todos;
+                if (!todoCache.scan(unit, hashCache, todos)) {
+                    continue;
+                }
+                for (auto&& todo : todos) {
+                    emit_job_output("[Dragon] Todo: " + todo + "\n", "");
+                }
+            }
+            if (todoCache.dirty || todoCache.used.size() != todoCache.files.size()) {
+                todoCache.save(todoFile);
+            }
+        });
+    }
 
-        tmp->push_back(unit);
-        tmp->push_back("-o");
-        tmp->push_back(outFile);
-        tmp->push_back("-c");
+    std::string historyFile = outDir + std::filesystem::path::preferred_separator + "build.drg.history";
+    HistoryBuild history;
+    history.timestamp = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    std::mutex historyLock;
 
-        if (!fullRebuild && std::filesystem::exists(outFile)) {
-            if (file_modified_time(unit) < file_modified_time(outFile)) {
+    std::atomic<bool> failed{false};
+    if (compileJobs.size()) {
+        size_t maxJobs = jobs ? jobs : default_job_count();
+        bool adaptive = parallelBuild && buildConfig->getStringOrDefault("adaptiveJobs", "false")->getValue() == "true";
+        if (adaptive) {
+            maxJobs = std::strtoul(buildConfig->getStringOrDefault("maxJobs", std::to_string(maxJobs))->getValue().c_str(), nullptr, 10);
+        }
+        uint64_t memoryLimit = memoryBudget ? memoryBudget : parse_size(buildConfig->getStringOrDefault("maxBuildMemory", "0")->getValue());
+        // targets run their compiles on the pool of their 'targets' section
+        // the monitor is declared last so it stops before the pool it adjusts
+        std::unique_ptr<JobPool> ownPool;
+        std::unique_ptr<LoadMonitor> monitor;
+        if (!buildTarget) {
+            ownPool = std::make_unique<JobPool>(parallelBuild ? std::min(maxJobs, compileJobs.size()) : 1, memoryLimit);
+            if (adaptive) {
+                size_t minJobs = std::strtoul(buildConfig->getStringOrDefault("minJobs", "1")->getValue().c_str(), nullptr, 10);
+                monitor = std::make_unique<LoadMonitor>(*ownPool, minJobs, ownPool->size());
+            }
+        }
+        JobPool& pool = buildTarget ? *buildTarget->graph->pool : *ownPool;
+        history.jobs = pool.size();
+        schedule_jobs(compileJobs, db);
+        auto compileStart = std::chrono::steady_clock::now();
+        if (buildTarget) {
+            DRAGON_LOG << "Building " << compileJobs.size() << " unit(s) of target " << buildTarget->name << std::endl;
+        } else if (monitor) {
+            DRAGON_LOG << "Building " << compileJobs.size() << " unit(s) with up to " << pool.size() << " job(s), starting with " << pool.getLimit() << std::endl;
+        } else {
+            DRAGON_LOG << "Building " << compileJobs.size() << " unit(s) with " << pool.size() << " job(s)" << std::endl;
+        }
+        for (size_t i = 0; i < pool.size() && !buildTarget; i++) {
+            trace_name_track(i + 1, "worker " + std::to_string(i + 1));
+        }
+        // returns the exit status of the compile, -1 if it was not started
+        auto compileJob = [&](const CompileJob& job, size_t worker, BuildRecord& record) {
+            // stop starting new compiles once one has failed
+            if (failed || buildCancelled) {
+                return -1;
+            }
+            TraceSpan span(job.unit, "compile", worker + 1);
+            span.arg("command", vecToString(job.command));
+            std::vector<std::string> deps;
+            std::string diagnostics;
+            uint64_t cacheKey = 0;
+            bool restored = false;
+            uint64_t sourceDigest;
+            if (objectCache && hashCache.digest(job.unit, sourceDigest)) {
+                cacheKey = hash_string(vecToString(job.command), hash_string(compiler_identity(job.command.front()), sourceDigest ^ pchDigest));
+                restored = objectCache->lookup(cacheKey, hashCache, job.outFile, deps, diagnostics);
+                if (restored) {
+                    span.arg("cache", "hit");
+                    BuildRecord* previous = db.find(job.outFile);
+                    if (previous) {
+                        record.durationMs = previous->durationMs;
+                        record.peakMemory = previous->peakMemory;
+                    }
+                    emit_job_output("[Dragon] Restored from cache: " + job.outFile + "\n", diagnostics);
+                }
+            }
+
+            if (!restored) {
+                ProcessUsage usage;
+                auto start = std::chrono::steady_clock::now();
+                set_process_tag(job.outFile);
+                record.exitStatus = spawn_process(job.command, &diagnostics, outputLimit, &usage);
+                set_process_tag("");
+                record.durationMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+                record.peakMemory = usage.peakMemory;
+                span.arg("peak memory", std::to_string(usage.peakMemory));
+                {
+                    std::lock_guard<std::mutex> guard(historyLock);
+                    history.entries.push_back(HistoryEntry{"compile", job.outFile, record.durationMs, usage.cpuMs, record.exitStatus});
+                }
+                span.arg("exit status", std::to_string(record.exitStatus));
+                if (record.exitStatus) {
+                    failed = true;
+                    std::filesystem::remove(job.outFile + ".d");
+                    db.record(job.outFile, record);
+                    if (buildCancelled) {
+                        emit_job_output("[Dragon] Cancelled: " + job.outFile + "\n", "");
+                    } else {
+                        emit_job_output("", diagnostics + "[Dragon] Error building " + job.outFile + " (exit status " + std::to_string(record.exitStatus) + ")\n");
+                    }
+                    return record.exitStatus;
+                }
+                if (trackDependencies) {
+                    deps = parse_depfile(job.outFile + ".d");
+                    std::filesystem::remove(job.outFile + ".d");
+                }
+                if (cacheKey) {
+                    objectCache->store(cacheKey, hashCache, job.outFile, deps, diagnostics, record.durationMs);
+                }
+                emit_job_output("[Dragon] Finished building: " + job.outFile + "\n", diagnostics);
+            }
+            record.commandHash = hash_string(vecToString(job.command));
+            record.deps = deps;
+            if (hashPolicy) {
+                hashCache.digestAll(unitInputs(job.unit, deps), record.inputDigest);
+            }
+            db.record(job.outFile, record);
+            return 0;
+        };
+        JobGroup group;
+        for (auto&& job : compileJobs) {
+            group.add();
+            // an identical compile of another target produces this object already
+            if (buildTarget && !buildTarget->graph->claim(job.outFile, [&db, &failed, &group, outFile = job.outFile](int exitStatus, const BuildRecord& record) {
+                if (exitStatus) {
+                    failed = true;
+                } else {
+                    db.record(outFile, record);
+                }
+                group.done();
+            })) {
                 continue;
             }
+            pool.submit([&](size_t worker) {
+                BuildRecord record;
+                int exitStatus = compileJob(job, worker, record);
+                if (buildTarget) {
+                    buildTarget->graph->publish(job.outFile, exitStatus, record);
+                }
+                group.done();
+            }, job.memory);
+        }
+        turn.release();
+        {
+            TraceSpan span("wait for compiles", "wait");
+            group.wait();
         }
+        monitor.reset();
+        ownPool.reset();
+        history.wallMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - compileStart).count();
+    }
+    turn.release();
 
-        std::thread thread([](std::vector<std::string>* tmp){
-            DRAGON_LOG << "Started building: " << tmp->at(tmp->size() - 2) << std::endl;
-            build(*tmp);
-            DRAGON_LOG << "Finished building: " << tmp->at(tmp->size() - 2) << std::endl;
-            delete tmp;
-        }, tmp);
-        if (parallelBuild) {
-            threads.push_back(std::move(thread));
+    if (todoScanner.joinable()) {
+        todoScanner.join();
+    }
+    if (incrementalBuild && (compileJobs.size() || hashCache.dirty)) {
+        db.save(databaseFile);
+    }
+    if (failed || buildCancelled) {
+        history_append(historyFile, history);
+        if (buildCancelled) {
+            DRAGON_LOG << "Build cancelled" << std::endl;
         } else {
-            thread.join();
+            DRAGON_ERR << "Build failed!" << std::endl;
         }
+        return "";
     }
 
+    std::vector<std::string> objects;
+
     cmd.push_back(buildConfig->getStringOrDefault("outFilePrefix", "-o")->getValue());
     cmd.push_back(outputFile);
 
     if (incrementalBuild) {
-        for (auto&& unit : units) {
-            cmd.push_back(
-                buildConfig->getStringOrDefault("outputDir", "build")->getValue() +
-                std::filesystem::path::preferred_separator +
-                replaceAll(unit.substr(sourceDirPrefixLen), "/", "@") +
-                ".o"
-            );
+        for (auto&& unit : compileUnits) {
+            objects.push_back(objectFile(unit));
+            cmd.push_back(objects.back());
+        }
+    }
+
+    // libraries found in the configured library paths are link inputs as well
+    std::vector<std::string> linkInputs(objects);
+    if (incrementalBuild) {
+        std::vector<std::string> libs(customLibs);
+        std::vector<std::string> libDirs(customLibraryPaths);
+        if (buildConfig->getList("libs")) {
+            for (u_long i = 0; i < buildConfig->getList("libs")->size(); i++) {
+                libs.push_back(buildConfig->getList("libs")->getString(i)->getValue());
+            }
+        }
+        if (buildConfig->getList("libraryPaths")) {
+            for (u_long i = 0; i < buildConfig->getList("libraryPaths")->size(); i++) {
+                libDirs.push_back(buildConfig->getList("libraryPaths")->getString(i)->getValue());
+            }
+        }
+        for (auto&& lib : libs) {
+            std::string resolved = find_library(lib, libDirs);
+            if (resolved.size()) {
+                linkInputs.push_back(resolved);
+            }
+        }
+    }
+
+    // shared libraries of other targets only cause a relink when the
+    // symbols they export changed, abiDigest covers all of them
+    std::vector<std::string> abiInputs;
+    uint64_t abiDigest = 0;
+    if (buildTarget) {
+        if (!buildTarget->waitForDeps()) {
+            return "";
+        }
+        for (auto&& lib : buildTarget->libraries()) {
+            cmd.push_back(lib->output);
+            linkInputs.push_back(lib->output);
+            if (lib->type != "shared") {
+                continue;
+            }
+#if !defined(_WIN32)
+            cmd.push_back("-Wl,-rpath," + std::filesystem::absolute(lib->output).parent_path().string());
+#endif
+            uint64_t digest;
+            if (shared_library_digest(lib->output, digest)) {
+                abiInputs.push_back(lib->output);
+                abiDigest = hash_string(lib->output, abiDigest ^ digest);
+            }
+        }
+    }
+    if (targetType == "static") {
+        // archives only hold the objects, libraries are linked by their users
+        // archives of LTO objects need an archiver that can index their bitcode
+        std::string archiver = lto.empty() ? "ar" : ltoClang ? "llvm-ar" : "gcc-ar";
+        cmd = {buildConfig->getStringOrDefault("archiver", archiver)->getValue(), "rcs", outputFile};
+        cmd.insert(cmd.end(), objects.begin(), objects.end());
+        linkInputs = objects;
+    } else if (targetType == "shared") {
+        std::string soname = buildConfig->getStringOrDefault("soname", std::filesystem::path(outputFile).filename().string())->getValue();
+        cmd.insert(cmd.begin() + 1, "-shared");
+#if defined(__APPLE__)
+        cmd.push_back("-Wl,-install_name,@rpath/" + soname);
+#elif !defined(_WIN32)
+        cmd.push_back("-Wl,-soname," + soname);
+#endif
+    }
+
+    BuildRecord* linkRecord = db.find(outputFile);
+    uint64_t linkHash = hash_string(vecToString(cmd));
+    if (targetType != "static") {
+        cmd.insert(cmd.end(), ltoJobFlags.begin(), ltoJobFlags.end());
+    }
+    bool relink = !incrementalBuild || rebuildAll || compileJobs.size() || !linkRecord || linkRecord->commandHash != linkHash || linkRecord->exitStatus != 0 || linkRecord->inputDigest != abiDigest;
+    int64_t outputTime;
+    if (!relink && modifiedTime(outputFile, outputTime)) {
+        for (size_t i = 0; i < linkInputs.size() && !relink; i++) {
+            if (std::find(abiInputs.begin(), abiInputs.end(), linkInputs[i]) != abiInputs.end()) {
+                continue;
+            }
+            int64_t inputTime;
+            relink = !modifiedTime(linkInputs[i], inputTime) || outputTime < inputTime;
         }
+    } else {
+        relink = true;
     }
 
-    for (auto&& thread : threads) {
-        thread.join();
+    // an archive from a successful build only gets the members of changed,
+    // new and removed objects updated
+    std::vector<std::string> changedMembers;
+    std::vector<std::string> removedMembers;
+    uint64_t archiveSize;
+    int64_t archiveTime;
+    bool updateArchive = relink && targetType == "static" && !rebuildAll && linkRecord && linkRecord->exitStatus == 0 && file_stat(outputFile, archiveSize, archiveTime);
+    if (updateArchive) {
+        for (auto&& object : objects) {
+            uint64_t objectSize;
+            int64_t objectTime;
+            if (std::find(linkRecord->deps.begin(), linkRecord->deps.end(), object) == linkRecord->deps.end() ||
+                !file_stat(object, objectSize, objectTime) || objectTime >= archiveTime) {
+                changedMembers.push_back(object);
+            }
+        }
+        for (auto&& previous : linkRecord->deps) {
+            if (std::find(objects.begin(), objects.end(), previous) == objects.end()) {
+                removedMembers.push_back(std::filesystem::path(previous).filename().string());
+            }
+        }
     }
 
-    DRAGON_LOG << "Running build command: " << vecToString(cmd) << std::endl;
+    if (relink) {
+        TraceSpan span("link", "link");
+        ProcessUsage usage;
+        auto start = std::chrono::steady_clock::now();
+        int ret;
+        if (updateArchive) {
+            DRAGON_LOG << "Updating archive " << outputFile << ": " << changedMembers.size() << " member(s) replaced, " << removedMembers.size() << " removed" << std::endl;
+            span.arg("replaced", std::to_string(changedMembers.size()));
+            span.arg("removed", std::to_string(removedMembers.size()));
+            ret = update_archive(cmd.front(), outputFile, changedMembers, removedMembers, &usage);
+        } else {
+            DRAGON_LOG << "Running build command: " << vecToString(cmd) << std::endl;
+            span.arg("command", vecToString(cmd));
+            if (targetType == "static") {
+                // ar keeps members of units that are gone otherwise
+                std::error_code ec;
+                std::filesystem::remove(outputFile, ec);
+            }
+            ret = build(cmd, &usage);
+        }
+        span.arg("exit status", std::to_string(ret));
+        span.end();
 
-    build(cmd);
+        if (incrementalBuild) {
+            BuildRecord record;
+            record.commandHash = linkHash;
+            record.inputDigest = abiDigest;
+            record.durationMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+            record.exitStatus = ret;
+            record.peakMemory = usage.peakMemory;
+            record.deps = linkInputs;
+            db.record(outputFile, record);
+            db.save(databaseFile);
+            history.entries.push_back(HistoryEntry{"link", outputFile, record.durationMs, usage.cpuMs, ret});
+            history_append(historyFile, history);
+        }
+        if (ret) {
+            DRAGON_ERR << "Build failed!" << std::endl;
+            return "";
+        }
+    } else {
+        // preBuild commands already ran, postBuild ones run as well so the
+        // two stay paired (e.g. removing and reinstalling the output)
+        DRAGON_LOG << "Target is up to date: " << outputFile << std::endl;
+    }
 
     if (buildConfig->getList(POST_BUILD_TAG)) {
         for (u_long i = 0; i < buildConfig->getList(POST_BUILD_TAG)->size(); i++) {
             DRAGON_LOG << "Running postbuild command: " << buildConfig->getList(POST_BUILD_TAG)->getString(i)->getValue() << std::endl;
-            int ret = system(buildConfig->getList(POST_BUILD_TAG)->getString(i)->getValue().c_str());
+            TraceSpan span("postBuild", "command");
+            span.arg("command", buildConfig->getList(POST_BUILD_TAG)->getString(i)->getValue());
+            int ret = run_command(buildConfig->getList(POST_BUILD_TAG)->getString(i)->getValue());
+            span.arg("exit status", std::to_string(ret));
             if (ret != 0) {
                 DRAGON_ERR << "Post-build command failed: " << buildConfig->getList(POST_BUILD_TAG)->getString(i)->getValue() << std::endl;
-                exit(ret);
+                return "";
             }
         }
     }
@@ -406,5 +1392,12 @@ std::string cmd_build(std::string& configFile, bool waitForInteract) {
         return "";
     }
 
-    return build_from_config(buildConfig);
+    std::string result;
+    {
+        TraceSpan span("build", "build");
+        span.arg("target", buildConfigRootEntry);
+        result = build_from_config(buildConfig);
+    }
+    trace_write();
+    return result;
 }
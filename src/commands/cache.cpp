@@ -0,0 +1,344 @@
+#include "../dragon.hpp"
+
+#include <iomanip>
+
+// Cache layout:
+//   manifests/<xx>/<key>      header sets seen for one (compiler, command, source) key
+//   objects/<xx>/<result>.o   cached object file
+//   objects/<xx>/<result>.txt compiler diagnostics followed by the compile time in ms
+//   stats                     hit/miss counters
+
+#define CACHE_MANIFEST_ENTRIES 16
+
+std::string default_cache_dir() {
+    const char* env = getenv("DRAGON_CACHE_DIR");
+    if (env && *env) {
+        return env;
+    }
+#if defined(_WIN32)
+    env = getenv("LOCALAPPDATA");
+    if (env && *env) {
+        return std::string(env) + "\\dragon\\cache";
+    }
+#else
+    env = getenv("XDG_CACHE_HOME");
+    if (env && *env) {
+        return std::string(env) + "/dragon";
+    }
+    env = getenv("HOME");
+    if (env && *env) {
+        return std::string(env) + "/.cache/dragon";
+    }
+#endif
+    return ".dragon-cache";
+}
+
+uint64_t parse_size(const std::string& str) {
+    char* end = nullptr;
+    double value = std::strtod(str.c_str(), &end);
+    switch (end ? toupper(*end) : 0) {
+        case 'K': value *= 1024.0; break;
+        case 'M': value *= 1024.0 * 1024.0; break;
+        case 'G': value *= 1024.0 * 1024.0 * 1024.0; break;
+        case 'T': value *= 1024.0 * 1024.0 * 1024.0 * 1024.0; break;
+        default: break;
+    }
+    return value > 0 ? (uint64_t) value : 0;
+}
+
+static std::string format_size(uint64_t bytes) {
+    const char* units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+    double value = bytes;
+    int unit = 0;
+    while (value >= 1024.0 && unit < 4) {
+        value /= 1024.0;
+        unit++;
+    }
+    std::ostringstream out;
+    out.precision(unit ? 1 : 0);
+    out << std::fixed << value << " " << units[unit];
+    return out.str();
+}
+
+std::string compiler_identity(const std::string& compiler) {
+    static std::mutex lock;
+    static std::map<std::string, std::string> identities;
+    std::lock_guard<std::mutex> guard(lock);
+    auto known = identities.find(compiler);
+    if (known != identities.end()) {
+        return known->second;
+    }
+
+    // the resolved driver binary together with its size and mtime changes
+    // whenever the compiler is upgraded or replaced
+    std::string resolved = find_program(compiler);
+    if (resolved.empty()) {
+        resolved = compiler;
+    }
+    std::error_code ec;
+    std::filesystem::path canonical = std::filesystem::canonical(resolved, ec);
+    if (!ec) {
+        resolved = canonical.string();
+    }
+    uint64_t size = 0;
+    int64_t mtime = 0;
+    file_stat(resolved, size, mtime);
+
+    std::string identity = resolved + ":" + std::to_string(size) + ":" + std::to_string(mtime);
+    identities[compiler] = identity;
+    return identity;
+}
+
+ObjectCache::ObjectCache(const std::string& dir, uint64_t maxSize) : dir(dir), maxSize(maxSize) {}
+
+std::string ObjectCache::path(const std::string& kind, uint64_t key, const std::string& extension) {
+    std::string name = hash_to_string(key);
+    return this->dir + std::filesystem::path::preferred_separator + kind +
+           std::filesystem::path::preferred_separator + name.substr(0, 2) +
+           std::filesystem::path::preferred_separator + name + extension;
+}
+
+static bool write_atomically(const std::string& path, const std::string& data) {
+    std::error_code ec;
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path(), ec);
+    std::string tmp = path + ".tmp" + std::to_string(hash_string(path, (uint64_t) std::hash<std::thread::id>()(std::this_thread::get_id())));
+    {
+        std::ofstream out(tmp, std::ios::binary);
+        if (!out) {
+            return false;
+        }
+        out << data;
+        if (!out) {
+            return false;
+        }
+    }
+    std::filesystem::rename(tmp, path, ec);
+    if (ec) {
+        std::filesystem::remove(tmp, ec);
+        return false;
+    }
+    return true;
+}
+
+static bool read_file(const std::string& path, std::string& data) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        return false;
+    }
+    data.assign((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    return true;
+}
+
+std::vector<ObjectCache::ManifestEntry> ObjectCache::readManifest(uint64_t key) {
+    std::vector<ManifestEntry> entries;
+    std::ifstream in(this->path("manifests", key, ""));
+    std::string line;
+    ManifestEntry* current = nullptr;
+    while (std::getline(in, line)) {
+        if (line.empty()) {
+            continue;
+        }
+        if (line.front() == '\t') {
+            if (current && line.size() > 18) {
+                current->deps.push_back(line.substr(18));
+                current->digests.push_back(std::strtoull(line.substr(1, 16).c_str(), nullptr, 16));
+            }
+        } else {
+            entries.push_back(ManifestEntry{std::strtoull(line.c_str(), nullptr, 16), {}, {}});
+            current = &entries.back();
+        }
+    }
+    return entries;
+}
+
+bool ObjectCache::lookup(uint64_t key, FileHashCache& hashes, const std::string& outFile, std::vector<std::string>& deps, std::string& diagnostics) {
+    for (auto&& entry : this->readManifest(key)) {
+        bool matches = true;
+        for (size_t i = 0; i < entry.deps.size() && matches; i++) {
+            uint64_t digest;
+            matches = hashes.digest(entry.deps[i], digest) && digest == entry.digests[i];
+        }
+        if (!matches) {
+            continue;
+        }
+        std::string object = this->path("objects", entry.result, ".o");
+        std::string meta;
+        if (!read_file(this->path("objects", entry.result, ".txt"), meta)) {
+            continue;
+        }
+        std::error_code ec;
+        std::filesystem::copy_file(object, outFile, std::filesystem::copy_options::overwrite_existing, ec);
+        if (ec) {
+            continue;
+        }
+        // hits refresh the entry so eviction drops the least recently used objects
+        std::filesystem::last_write_time(object, std::filesystem::file_time_type::clock::now(), ec);
+
+        size_t timeStart = meta.find_last_of('\n');
+        diagnostics = meta.substr(0, timeStart);
+        this->timeSavedMs += std::strtoull(meta.c_str() + timeStart + 1, nullptr, 10);
+        this->bytesServed += std::filesystem::file_size(outFile, ec);
+        this->hits++;
+        deps = entry.deps;
+        return true;
+    }
+    this->misses++;
+    return false;
+}
+
+void ObjectCache::store(uint64_t key, FileHashCache& hashes, const std::string& outFile, const std::vector<std::string>& deps, const std::string& diagnostics, uint64_t durationMs) {
+    ManifestEntry entry{key, deps, {}};
+    for (auto&& dep : deps) {
+        uint64_t digest;
+        if (!hashes.digest(dep, digest)) {
+            return;
+        }
+        entry.digests.push_back(digest);
+        entry.result = hash_string(dep, entry.result ^ digest);
+    }
+
+    std::string object;
+    if (!read_file(outFile, object)) {
+        return;
+    }
+    if (!write_atomically(this->path("objects", entry.result, ".o"), object) ||
+        !write_atomically(this->path("objects", entry.result, ".txt"), diagnostics + "\n" + std::to_string(durationMs))) {
+        return;
+    }
+    this->bytesStored += object.size();
+
+    std::lock_guard<std::mutex> guard(this->manifestLock);
+    std::vector<ManifestEntry> entries = this->readManifest(key);
+    entries.insert(entries.begin(), entry);
+    std::string manifest;
+    for (size_t i = 0; i < entries.size() && i < CACHE_MANIFEST_ENTRIES; i++) {
+        if (i && entries[i].result == entry.result) {
+            continue;
+        }
+        manifest += hash_to_string(entries[i].result) + "\n";
+        for (size_t j = 0; j < entries[i].deps.size(); j++) {
+            manifest += "\t" + hash_to_string(entries[i].digests[j]) + " " + entries[i].deps[j] + "\n";
+        }
+    }
+    write_atomically(this->path("manifests", key, ""), manifest);
+}
+
+std::map<std::string, uint64_t> ObjectCache::readStats() {
+    std::map<std::string, uint64_t> stats;
+    std::ifstream in(this->dir + std::filesystem::path::preferred_separator + "stats");
+    std::string name;
+    uint64_t value;
+    while (in >> name >> value) {
+        stats[name] = value;
+    }
+    return stats;
+}
+
+void ObjectCache::flush() {
+    std::map<std::string, uint64_t> stats = this->readStats();
+    stats["hits"] += this->hits;
+    stats["misses"] += this->misses;
+    stats["bytesServed"] += this->bytesServed;
+    stats["timeSavedMs"] += this->timeSavedMs;
+    stats["size"] += this->bytesStored;
+    this->hits = this->misses = this->bytesServed = this->timeSavedMs = this->bytesStored = 0;
+
+    if (this->maxSize && stats["size"] > this->maxSize) {
+        stats["size"] = this->evict(this->maxSize - this->maxSize / 10);
+    }
+
+    std::string data;
+    for (auto&& stat : stats) {
+        data += stat.first + " " + std::to_string(stat.second) + "\n";
+    }
+    write_atomically(this->dir + std::filesystem::path::preferred_separator + "stats", data);
+}
+
+uint64_t ObjectCache::evict(uint64_t targetSize) {
+    struct CachedObject {
+        std::filesystem::path path;
+        std::filesystem::file_time_type used;
+        uint64_t size;
+    };
+    std::vector<CachedObject> objects;
+    uint64_t total = 0;
+    std::error_code ec;
+    std::string objectDir = this->dir + std::filesystem::path::preferred_separator + "objects";
+    for (auto& p : std::filesystem::recursive_directory_iterator(objectDir, ec)) {
+        if (p.is_regular_file(ec) && p.path().extension() == ".o") {
+            uint64_t size = p.file_size(ec);
+            objects.push_back(CachedObject{p.path(), p.last_write_time(ec), size});
+            total += size;
+        }
+    }
+    std::sort(objects.begin(), objects.end(), [](const CachedObject& a, const CachedObject& b) {
+        return a.used < b.used;
+    });
+    for (auto&& object : objects) {
+        if (total <= targetSize) {
+            break;
+        }
+        std::filesystem::remove(object.path, ec);
+        std::filesystem::path meta = object.path;
+        std::filesystem::remove(meta.replace_extension(".txt"), ec);
+        total -= object.size;
+    }
+    return total;
+}
+
+void cache_help() {
+    DRAGON_LOG << "Usage: dragon cache <command>" << std::endl;
+    DRAGON_LOG << "Commands:" << std::endl;
+    DRAGON_LOG << "  help        Display this help message." << std::endl;
+    DRAGON_LOG << "  stats       Show object cache statistics." << std::endl;
+    DRAGON_LOG << "  clear       Remove all cached objects." << std::endl;
+}
+
+int cmd_cache(std::vector<std::string> args) {
+    if (args.size() == 0) {
+        DRAGON_ERR << "'cache' requires a subcommand." << std::endl;
+        return 1;
+    }
+
+    std::string cacheDir = default_cache_dir();
+    uint64_t maxSize = parse_size(DRAGON_CACHE_MAX_SIZE);
+    if (std::filesystem::exists(buildConfigFile)) {
+        DragonConfig::ConfigParser parser;
+        DragonConfig::CompoundEntry* root = parser.parse(buildConfigFile);
+        DragonConfig::CompoundEntry* buildConfig = root ? root->getCompound(buildConfigRootEntry) : nullptr;
+        if (buildConfig) {
+            cacheDir = buildConfig->getStringOrDefault("cacheDir", cacheDir)->getValue();
+            maxSize = parse_size(buildConfig->getStringOrDefault("cacheMaxSize", DRAGON_CACHE_MAX_SIZE)->getValue());
+        }
+    }
+    ObjectCache cache(cacheDir, maxSize);
+
+    std::string command = args[0];
+    if (command == "help") {
+        cache_help();
+        return 0;
+    } else if (command == "stats") {
+        std::map<std::string, uint64_t> stats = cache.readStats();
+        uint64_t lookups = stats["hits"] + stats["misses"];
+        DRAGON_LOG << "Cache directory: " << cacheDir << std::endl;
+        DRAGON_LOG << "Hits:            " << stats["hits"] << std::endl;
+        DRAGON_LOG << "Misses:          " << stats["misses"] << std::endl;
+        DRAGON_LOG << "Hit rate:        " << std::fixed << std::setprecision(1) << (lookups ? stats["hits"] * 100.0 / lookups : 0.0) << "%" << std::endl;
+        DRAGON_LOG << "Bytes served:    " << format_size(stats["bytesServed"]) << std::endl;
+        DRAGON_LOG << "Time saved:      " << std::setprecision(2) << stats["timeSavedMs"] / 1000.0 << "s" << std::endl;
+        DRAGON_LOG << "Size:            " << format_size(stats["size"]) << " / " << format_size(maxSize) << std::endl;
+        return 0;
+    } else if (command == "clear") {
+        std::error_code ec;
+        std::filesystem::remove_all(cacheDir, ec);
+        if (ec) {
+            DRAGON_ERR << "Failed to clear cache: " << ec.message() << std::endl;
+            return 1;
+        }
+        DRAGON_LOG << "Cleared " << cacheDir << std::endl;
+        return 0;
+    } else {
+        DRAGON_ERR << "Unknown subcommand '" << command << "'." << std::endl;
+        return 1;
+    }
+}
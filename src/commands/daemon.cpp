@@ -0,0 +1,487 @@
+#include "../dragon.hpp"
+
+#if defined(__linux__)
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+// A request is a u32 length followed by that many bytes of NUL separated
+// fields: the kind (build, ping or stop), the working directory of the
+// client and, for builds, its command line options. Build requests carry
+// the client's stdout and stderr as SCM_RIGHTS. The reply is an i32 exit
+// status, or DAEMON_FALLBACK if the client has to build by itself.
+#define DAEMON_FALLBACK -1
+
+static std::string socket_path(const std::string& configFile) {
+    return configFile + ".sock";
+}
+
+static bool socket_address(const std::string& path, struct sockaddr_un& addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    return true;
+}
+
+static bool write_all(int fd, const void* data, size_t len) {
+    const char* p = (const char*) data;
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool read_all(int fd, void* data, size_t len) {
+    char* p = (char*) data;
+    while (len) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static std::string current_dir() {
+    std::error_code ec;
+    return std::filesystem::current_path(ec).string();
+}
+
+// Sends a request and waits for the reply, returns false if there is no daemon
+static bool send_request(const std::string& configFile, const std::vector<std::string>& fields, bool passOutput, int& reply) {
+    struct sockaddr_un addr;
+    if (!socket_address(socket_path(configFile), addr)) {
+        return false;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return false;
+    }
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        close(fd);
+        return false;
+    }
+
+    std::string payload;
+    for (auto&& field : fields) {
+        payload += field;
+        payload.push_back('\0');
+    }
+    uint32_t len = payload.size();
+
+    struct iovec iov = {&len, sizeof(len)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    alignas(struct cmsghdr) char control[CMSG_SPACE(2 * sizeof(int))];
+    if (passOutput) {
+        int fds[2] = {STDOUT_FILENO, STDERR_FILENO};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    }
+
+    std::cout.flush();
+    std::cerr.flush();
+    int32_t status;
+    bool ok = sendmsg(fd, &msg, MSG_NOSIGNAL) == (ssize_t) sizeof(len) &&
+              write_all(fd, payload.data(), payload.size()) &&
+              read_all(fd, &status, sizeof(status));
+    close(fd);
+    if (ok) {
+        reply = status;
+    }
+    return ok;
+}
+
+struct DaemonRequest {
+    std::vector<std::string> fields;
+    int out = -1;
+    int err = -1;
+};
+
+static bool receive_request(int fd, DaemonRequest& request) {
+    uint32_t len;
+    struct iovec iov = {&len, sizeof(len)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    alignas(struct cmsghdr) char control[CMSG_SPACE(2 * sizeof(int))];
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != (ssize_t) sizeof(len)) {
+        return false;
+    }
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len == CMSG_LEN(2 * sizeof(int))) {
+        int fds[2];
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+        request.out = fds[0];
+        request.err = fds[1];
+    }
+    if (len > 1024 * 1024) {
+        return false;
+    }
+    std::string payload(len, '\0');
+    if (!read_all(fd, &payload[0], len)) {
+        return false;
+    }
+    size_t start = 0;
+    for (size_t i = 0; i < payload.size(); i++) {
+        if (payload[i] == '\0') {
+            request.fields.push_back(payload.substr(start, i - start));
+            start = i + 1;
+        }
+    }
+    return request.fields.size() >= 2;
+}
+
+static bool has_build_commands(DragonConfig::CompoundEntry* config) {
+    return config->getList("preBuild") || config->getList("postBuild") ||
+           config->getList("preBuildWin") || config->getList("postBuildWin");
+}
+
+// Directories of every dependency recorded by the last build, in the
+// session database or in the databases of the targets
+static std::set<std::string> dependency_dirs(DragonConfig::CompoundEntry* buildConfig, BuildDatabase& db) {
+    std::set<std::string> dirs;
+    auto collect = [&dirs](BuildDatabase& database) {
+        std::lock_guard<std::mutex> guard(database.lock);
+        for (auto&& record : database.records) {
+            for (auto&& dep : record.second.deps) {
+                std::string dir = std::filesystem::path(dep).parent_path().lexically_normal().string();
+                dirs.insert(dir.empty() ? "." : dir);
+            }
+        }
+    };
+
+    DragonConfig::CompoundEntry* section = buildConfig->getCompound("targets");
+    if (!section) {
+        collect(db);
+        return dirs;
+    }
+    // targets keep their databases in their own output directories, see build_targets
+    std::string outDir = buildConfig->getStringOrDefault("outputDir", "build")->getValue();
+    for (auto&& entry : section->entries) {
+        if (entry->getType() != DragonConfig::EntryType::Compound) {
+            continue;
+        }
+        DragonConfig::CompoundEntry* targetConfig = reinterpret_cast<DragonConfig::CompoundEntry*>(entry);
+        std::string targetDir = targetConfig->getStringOrDefault("outputDir", outDir + std::filesystem::path::preferred_separator + entry->getKey())->getValue();
+        std::string databaseFile = targetDir + std::filesystem::path::preferred_separator + "build.drg.db";
+        BuildDatabase targetDb;
+        if (std::filesystem::exists(databaseFile) && targetDb.load(databaseFile)) {
+            collect(targetDb);
+        }
+    }
+    return dirs;
+}
+
+static void daemon_help() {
+    DRAGON_LOG << "Usage: dragon daemon <command> [options]" << std::endl;
+    DRAGON_LOG << "Commands:" << std::endl;
+    DRAGON_LOG << "  help        Display this help message." << std::endl;
+    DRAGON_LOG << "  start       Start a build server for this project, builds with the same options are sent to it." << std::endl;
+    DRAGON_LOG << "  stop        Stop the build server." << std::endl;
+    DRAGON_LOG << "  status      Show whether a build server is running." << std::endl;
+}
+#endif
+
+bool daemon_build(std::string& configFile, const std::vector<std::string>& options, int& status) {
+#if defined(__linux__)
+    if (!std::filesystem::exists(socket_path(configFile))) {
+        return false;
+    }
+    std::vector<std::string> fields = {"build", current_dir()};
+    fields.insert(fields.end(), options.begin(), options.end());
+    int reply;
+    if (!send_request(configFile, fields, true, reply) || reply == DAEMON_FALLBACK) {
+        return false;
+    }
+    status = reply;
+    return true;
+#else
+    (void) configFile;
+    (void) options;
+    (void) status;
+    return false;
+#endif
+}
+
+int cmd_daemon(std::vector<std::string> args) {
+#if defined(__linux__)
+    if (args.size() == 0) {
+        DRAGON_ERR << "'daemon' requires a subcommand." << std::endl;
+        return 1;
+    }
+    std::string command = args[0];
+    std::vector<std::string> options(args.begin() + 1, args.end());
+    std::string configFile = buildConfigFile;
+    for (size_t i = 0; i + 1 < options.size(); i++) {
+        if (options[i] == "-c" || options[i] == "--buildConfig") {
+            configFile = options[i + 1];
+        }
+    }
+
+    int reply;
+    if (command == "help") {
+        daemon_help();
+        return 0;
+    } else if (command == "status") {
+        if (send_request(configFile, {"ping", current_dir()}, false, reply)) {
+            DRAGON_LOG << "Build server running on " << socket_path(configFile) << std::endl;
+            return 0;
+        }
+        DRAGON_LOG << "No build server running" << std::endl;
+        return 1;
+    } else if (command == "stop") {
+        if (!send_request(configFile, {"stop", current_dir()}, false, reply)) {
+            DRAGON_ERR << "No build server running" << std::endl;
+            return 1;
+        }
+        DRAGON_LOG << "Stopped build server" << std::endl;
+        return 0;
+    } else if (command == "start") {
+        if (send_request(configFile, {"ping", current_dir()}, false, reply)) {
+            DRAGON_ERR << "Build server already running on " << socket_path(configFile) << std::endl;
+            return 1;
+        }
+        pid_t pid = fork();
+        if (pid < 0) {
+            DRAGON_ERR << "Failed to start build server: " << strerror(errno) << std::endl;
+            return 1;
+        }
+        if (pid == 0) {
+            setsid();
+            int null = open("/dev/null", O_RDWR);
+            dup2(null, STDIN_FILENO);
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+            std::vector<std::string> serveArgs = {"dragon", "serve"};
+            serveArgs.insert(serveArgs.end(), options.begin(), options.end());
+            std::vector<char*> argv;
+            for (auto&& arg : serveArgs) {
+                argv.push_back(const_cast<char*>(arg.c_str()));
+            }
+            argv.push_back(nullptr);
+            execv("/proc/self/exe", argv.data());
+            _exit(127);
+        }
+        for (int i = 0; i < 100; i++) {
+            if (send_request(configFile, {"ping", current_dir()}, false, reply)) {
+                DRAGON_LOG << "Build server running on " << socket_path(configFile) << std::endl;
+                return 0;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+        DRAGON_ERR << "Build server did not start" << std::endl;
+        return 1;
+    } else {
+        DRAGON_ERR << "Unknown subcommand '" << command << "'." << std::endl;
+        return 1;
+    }
+#else
+    (void) args;
+    DRAGON_ERR << "'daemon' is only supported on Linux" << std::endl;
+    return 1;
+#endif
+}
+
+int cmd_serve(std::string& configFile, const std::vector<std::string>& options) {
+#if defined(__linux__)
+    DragonConfig::CompoundEntry* buildConfig = load_build_config(configFile);
+    if (!buildConfig) {
+        return 1;
+    }
+    // clients may go away in the middle of a build
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sockaddr_un addr;
+    std::string path = socket_path(configFile);
+    if (!socket_address(path, addr)) {
+        DRAGON_ERR << "Socket path too long: " << path << std::endl;
+        return 1;
+    }
+    int listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(path.c_str());
+    if (listenFd < 0 || bind(listenFd, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(listenFd, 8) != 0) {
+        DRAGON_ERR << "Failed to listen on " << path << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    FileWatcher watcher;
+    if (!watcher.open(configFile)) {
+        return 1;
+    }
+    std::vector<std::string> dirs = watched_dirs(buildConfig);
+    for (auto&& dir : dirs) {
+        watcher.add(dir, true);
+    }
+    if (buildConfig->getList("libraryPaths")) {
+        for (u_long i = 0; i < buildConfig->getList("libraryPaths")->size(); i++) {
+            watcher.add(buildConfig->getList("libraryPaths")->getString(i)->getValue(), false);
+        }
+    }
+    std::string outputDir = std::filesystem::path(buildConfig->getStringOrDefault("outputDir", "build")->getValue()).lexically_normal().string();
+    std::string cwd = current_dir();
+
+    // everything the in-process build would re-read stays in memory, the
+    // watcher tells when any of it may have changed
+    BuildDatabase db;
+    bool dirty = true;
+    bool configChanged = false;
+    std::string lastOutput;
+    auto drain = [&]() {
+        for (auto&& changed : watcher.read()) {
+            if (strstarts(changed, outputDir + std::filesystem::path::preferred_separator) || changed == outputDir) {
+                continue;
+            }
+            dirty = true;
+            if (changed == watcher.configPath) {
+                configChanged = true;
+            }
+        }
+    };
+
+    // dependencies outside the watched directories, like headers found
+    // through -I in flags or "../" includes, are watched through their
+    // directory once a build recorded them. Changes to them during that
+    // build may have been missed, so the next request builds again, as it
+    // does while a directory cannot be watched.
+    std::set<std::string> depDirs;
+    auto watchDeps = [&]() {
+        for (auto&& dir : dependency_dirs(buildConfig, db)) {
+            if (depDirs.count(dir)) {
+                continue;
+            }
+            dirty = true;
+            // only the config file is reported from its directory
+            int wd = watcher.add(dir, false);
+            if (wd >= 0 && wd != watcher.configWd) {
+                depDirs.insert(dir);
+            }
+        }
+    };
+
+    bool running = true;
+    while (running) {
+        struct pollfd pfds[2] = {{listenFd, POLLIN, 0}, {watcher.fd, POLLIN, 0}};
+        if (poll(pfds, 2, -1) < 0) {
+            continue;
+        }
+        drain();
+        if (!(pfds[0].revents & POLLIN)) {
+            continue;
+        }
+        int client = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0) {
+            continue;
+        }
+
+        DaemonRequest request;
+        int32_t status = DAEMON_FALLBACK;
+        if (receive_request(client, request)) {
+            std::vector<std::string> requestOptions(request.fields.begin() + 2, request.fields.end());
+            if (request.fields[0] == "ping") {
+                status = 0;
+            } else if (request.fields[0] == "stop") {
+                status = 0;
+                running = false;
+            } else if (request.fields[0] == "build" && request.fields[1] == cwd && requestOptions == options && request.out >= 0) {
+                std::cout.flush();
+                std::cerr.flush();
+                int savedOut = dup(STDOUT_FILENO);
+                int savedErr = dup(STDERR_FILENO);
+                dup2(request.out, STDOUT_FILENO);
+                dup2(request.err, STDERR_FILENO);
+
+                if (configChanged) {
+                    configChanged = false;
+                    DragonConfig::CompoundEntry* reloaded = load_build_config(configFile);
+                    if (reloaded) {
+                        buildConfig = reloaded;
+                        for (auto&& dir : watched_dirs(buildConfig)) {
+                            if (std::find(dirs.begin(), dirs.end(), dir) == dirs.end()) {
+                                dirs.push_back(dir);
+                                watcher.add(dir, true);
+                            }
+                        }
+                    }
+                }
+                // build_from_config runs preBuild and postBuild commands
+                // even when the target is up to date, so a config with
+                // any of them always goes through it, as does a server
+                // started with -fullRebuild. Each build starts from that
+                // option, a full rebuild forced by a watched file or
+                // config change does not carry over to later requests.
+                bool commands = has_build_commands(buildConfig);
+                DragonConfig::CompoundEntry* section = buildConfig->getCompound("targets");
+                for (size_t i = 0; section && i < section->entries.size(); i++) {
+                    if (section->entries[i]->getType() == DragonConfig::EntryType::Compound) {
+                        commands = commands || has_build_commands(reinterpret_cast<DragonConfig::CompoundEntry*>(section->entries[i]));
+                    }
+                }
+                if (!fullRebuild && !dirty && !commands && lastOutput.size() && std::filesystem::exists(lastOutput)) {
+                    DRAGON_LOG << "Target is up to date: " << lastOutput << std::endl;
+                    status = 0;
+                } else {
+                    dirty = false;
+                    lastOutput = build_from_config(buildConfig, &db);
+                    status = lastOutput.empty() ? 1 : 0;
+                    // changes made while building need another build
+                    drain();
+                    watchDeps();
+                }
+
+                std::cout.flush();
+                std::cerr.flush();
+                dup2(savedOut, STDOUT_FILENO);
+                dup2(savedErr, STDERR_FILENO);
+                close(savedOut);
+                close(savedErr);
+            }
+        }
+        if (request.out >= 0) {
+            close(request.out);
+        }
+        if (request.err >= 0) {
+            close(request.err);
+        }
+        write_all(client, &status, sizeof(status));
+        close(client);
+    }
+
+    close(listenFd);
+    unlink(path.c_str());
+    return 0;
+#else
+    (void) configFile;
+    (void) options;
+    DRAGON_ERR << "'serve' is only supported on Linux" << std::endl;
+    return 1;
+#endif
+}
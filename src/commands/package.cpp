@@ -7,8 +7,6 @@ void pkg_help() {
     DRAGON_LOG << "  install     Install a package." << std::endl;
 }
 
-std::string build_from_config(DragonConfig::CompoundEntry* buildConfig);
-
 // layout: 
 //   dragon package install StonkDragon/Scale
 //   dragon package install StonkDragon/Scale v23.7
@@ -2,7 +2,13 @@
 
 void cmd_run(std::string& configFile) {
     std::string outfile = cmd_build(configFile);
+    if (outfile.empty()) {
+        exit(1);
+    }
     std::string cmd = outfile;
+    if (cmd.find(std::filesystem::path::preferred_separator) == std::string::npos) {
+        cmd = std::string(".") + std::filesystem::path::preferred_separator + cmd;
+    }
 
     DragonConfig::ConfigParser parser;
     DragonConfig::CompoundEntry* root = parser.parse(configFile);
@@ -22,12 +28,11 @@ void cmd_run(std::string& configFile) {
 }
 
 void run_with_args(std::string& cmd, std::vector<std::string>& argv) {
-    std::string args;
-    for (auto arg : argv) {
-        args += arg + " ";
-    }
+    std::vector<std::string> args;
+    args.push_back(cmd);
+    args.insert(args.end(), argv.begin(), argv.end());
 
-    int ret = system(args.c_str());
+    int ret = spawn_process(args);
     if (ret) {
         DRAGON_ERR << "Error running " << cmd << std::endl;
         exit(ret);
@@ -0,0 +1,136 @@
+#include "../dragon.hpp"
+
+#include <iomanip>
+
+static std::string format_seconds(uint64_t ms) {
+    std::stringstream out;
+    out << std::fixed << std::setprecision(2) << ms / 1000.0 << "s";
+    return out.str();
+}
+
+static void print_history(const std::string& historyFile, size_t buildCount, size_t unitCount) {
+    std::vector<HistoryBuild> builds = history_load(historyFile);
+    if (builds.empty()) {
+        DRAGON_LOG << "No build history recorded in " << historyFile << std::endl;
+        return;
+    }
+    size_t first = builds.size() > buildCount ? builds.size() - buildCount : 0;
+    size_t window = builds.size() - first;
+
+    // wall times per unit for each build in the window, -1 where it was not compiled
+    std::map<std::string, std::vector<int64_t>> unitTimes;
+    std::map<std::string, uint64_t> unitCpu;
+    for (size_t i = first; i < builds.size(); i++) {
+        for (auto&& entry : builds[i].entries) {
+            if (entry.kind != "compile" || entry.exitStatus != 0) {
+                continue;
+            }
+            std::vector<int64_t>& times = unitTimes[entry.output];
+            times.resize(window, -1);
+            times[i - first] = entry.wallMs;
+            unitCpu[entry.output] = entry.cpuMs;
+        }
+    }
+
+    struct UnitSummary {
+        std::string output;
+        uint64_t lastMs;
+        uint64_t averageMs;
+    };
+    std::vector<UnitSummary> units;
+    for (auto&& unit : unitTimes) {
+        uint64_t total = 0;
+        size_t count = 0;
+        uint64_t last = 0;
+        for (auto&& time : unit.second) {
+            if (time >= 0) {
+                total += time;
+                count++;
+                last = time;
+            }
+        }
+        units.push_back(UnitSummary{unit.first, last, total / count});
+    }
+    std::sort(units.begin(), units.end(), [](const UnitSummary& a, const UnitSummary& b) {
+        return a.lastMs > b.lastMs;
+    });
+
+    DRAGON_LOG << "History of the last " << window << " of " << builds.size() << " build(s) in " << historyFile << std::endl;
+    if (units.size()) {
+        DRAGON_LOG << "Slowest units:" << std::endl;
+        std::cout << std::setw(10) << "last" << std::setw(10) << "average" << std::setw(10) << "cpu" << "  " << "trend (oldest to newest), unit" << std::endl;
+        for (size_t i = 0; i < units.size() && i < unitCount; i++) {
+            std::cout << std::setw(10) << format_seconds(units[i].lastMs)
+                      << std::setw(10) << format_seconds(units[i].averageMs)
+                      << std::setw(10) << format_seconds(unitCpu[units[i].output]) << "  ";
+            for (auto&& time : unitTimes[units[i].output]) {
+                std::cout << (time >= 0 ? format_seconds(time) : "-") << " ";
+            }
+            std::cout << units[i].output << std::endl;
+        }
+    }
+
+    uint64_t serialMs = 0;
+    uint64_t parallelMs = 0;
+    for (size_t i = first; i < builds.size(); i++) {
+        for (auto&& entry : builds[i].entries) {
+            if (entry.kind == "compile") {
+                serialMs += entry.wallMs;
+            }
+        }
+        parallelMs += builds[i].wallMs;
+    }
+
+    const HistoryBuild& last = builds.back();
+    uint64_t lastSerialMs = 0;
+    size_t lastUnits = 0;
+    for (auto&& entry : last.entries) {
+        if (entry.kind == "compile") {
+            lastSerialMs += entry.wallMs;
+            lastUnits++;
+        } else if (entry.kind == "link") {
+            DRAGON_LOG << "Last link: " << format_seconds(entry.wallMs) << " wall, " << format_seconds(entry.cpuMs) << " cpu" << std::endl;
+        }
+    }
+    if (lastUnits) {
+        DRAGON_LOG << "Last build: " << lastUnits << " unit(s) with " << last.jobs << " job(s), serial " << format_seconds(lastSerialMs)
+                   << ", parallel " << format_seconds(last.wallMs) << " (" << std::fixed << std::setprecision(2)
+                   << (last.wallMs ? (double) lastSerialMs / last.wallMs : 1.0) << "x)" << std::endl;
+    }
+    DRAGON_LOG << "Last " << window << " build(s): serial " << format_seconds(serialMs) << ", parallel " << format_seconds(parallelMs) << std::endl;
+}
+
+int cmd_stats(std::string& configFile, size_t buildCount, size_t unitCount) {
+    if (!std::filesystem::exists(configFile)) {
+        DRAGON_ERR << "Config file not found!" << std::endl;
+        DRAGON_ERR << "Have you forgot to run 'dragon init'?" << std::endl;
+        return 1;
+    }
+
+    DragonConfig::ConfigParser parser;
+    DragonConfig::CompoundEntry* root = parser.parse(configFile);
+    DragonConfig::CompoundEntry* buildConfig = root->getCompound(buildConfigRootEntry);
+    if (!buildConfig) {
+        DRAGON_ERR << "No build config with name '" << buildConfigRootEntry << "' found!" << std::endl;
+        return 1;
+    }
+
+    std::string outDir = buildConfig->getStringOrDefault("outputDir", "build")->getValue();
+    DragonConfig::CompoundEntry* section = buildConfig->getCompound("targets");
+    if (!section) {
+        print_history(outDir + std::filesystem::path::preferred_separator + "build.drg.history", buildCount, unitCount);
+        return 0;
+    }
+
+    // each target keeps its history in its own output directory, see build_targets
+    for (auto&& entry : section->entries) {
+        if (entry->getType() != DragonConfig::EntryType::Compound) {
+            continue;
+        }
+        DragonConfig::CompoundEntry* targetConfig = reinterpret_cast<DragonConfig::CompoundEntry*>(entry);
+        std::string targetDir = targetConfig->getStringOrDefault("outputDir", outDir + std::filesystem::path::preferred_separator + entry->getKey())->getValue();
+        DRAGON_LOG << "Target " << entry->getKey() << ":" << std::endl;
+        print_history(targetDir + std::filesystem::path::preferred_separator + "build.drg.history", buildCount, unitCount);
+    }
+    return 0;
+}
@@ -0,0 +1,250 @@
+#include "../dragon.hpp"
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+
+#define WATCH_DEBOUNCE_MS 150
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_DELETE_SELF)
+
+bool FileWatcher::open(const std::string& configFile) {
+    this->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (this->fd < 0) {
+        DRAGON_ERR << "Failed to initialize inotify: " << strerror(errno) << std::endl;
+        return false;
+    }
+    // editors often replace files instead of writing them, so the config
+    // is watched through its directory
+    std::string configDir = std::filesystem::path(configFile).parent_path().string();
+    this->configPath = std::filesystem::path(configFile).lexically_normal().string();
+    this->configWd = this->add(configDir.empty() ? "." : configDir, false);
+    return true;
+}
+
+FileWatcher::~FileWatcher() {
+    if (this->fd >= 0) {
+        close(this->fd);
+    }
+}
+
+int FileWatcher::add(const std::string& dir, bool recursive) {
+    int wd = inotify_add_watch(this->fd, dir.c_str(), WATCH_MASK);
+    if (wd < 0) {
+        DRAGON_ERR << "Cannot watch " << dir << ": " << strerror(errno) << std::endl;
+        return wd;
+    }
+    this->dirs[wd] = dir;
+    if (!recursive) {
+        return wd;
+    }
+    std::error_code ec;
+    for (auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+        if (entry.is_directory(ec) && !entry.is_symlink(ec)) {
+            this->add(entry.path().string(), true);
+        }
+    }
+    return wd;
+}
+
+std::vector<std::string> FileWatcher::read() {
+    std::vector<std::string> changed;
+    alignas(struct inotify_event) char buf[16384];
+    ssize_t len;
+    while ((len = ::read(this->fd, buf, sizeof(buf))) > 0) {
+        for (char* p = buf; p < buf + len; ) {
+            struct inotify_event* event = (struct inotify_event*) p;
+            p += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                // events were lost, report an unknown change
+                changed.push_back("");
+                continue;
+            }
+            auto dir = this->dirs.find(event->wd);
+            if (dir == this->dirs.end()) {
+                continue;
+            }
+            if (event->mask & IN_IGNORED) {
+                this->dirs.erase(dir);
+                continue;
+            }
+            std::string path = std::filesystem::path(event->len ? dir->second + std::filesystem::path::preferred_separator + event->name : dir->second).lexically_normal().string();
+            if (event->wd == this->configWd && path != this->configPath) {
+                continue;
+            }
+            if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+                this->add(path, true);
+            }
+            changed.push_back(path);
+        }
+    }
+    return changed;
+}
+#endif
+
+DragonConfig::CompoundEntry* load_build_config(std::string& configFile) {
+    DragonConfig::ConfigParser parser;
+    DragonConfig::CompoundEntry* root = parser.parse(configFile);
+    DragonConfig::CompoundEntry* buildConfig = root ? root->getCompound(buildConfigRootEntry) : nullptr;
+    if (!buildConfig) {
+        DRAGON_ERR << "No build config with name '" << buildConfigRootEntry << "' found!" << std::endl;
+    }
+    return buildConfig;
+}
+
+static void add_watched_dir(std::vector<std::string>& dirs, const std::string& dir) {
+    if (std::find(dirs.begin(), dirs.end(), dir) == dirs.end()) {
+        dirs.push_back(dir);
+    }
+}
+
+// sourceDir and includes of config, the keys it does not set itself come
+// from the enclosing config like in build_targets
+static void add_config_dirs(std::vector<std::string>& dirs, DragonConfig::CompoundEntry* config, DragonConfig::CompoundEntry* enclosing) {
+    DragonConfig::CompoundEntry* sourceConfig = config->hasMember("sourceDir") ? config : enclosing;
+    add_watched_dir(dirs, sourceConfig->getStringOrDefault("sourceDir", "src")->getValue());
+    DragonConfig::ListEntry* includes = config->hasMember("includes") ? config->getList("includes") : enclosing->getList("includes");
+    for (u_long i = 0; includes && i < includes->size(); i++) {
+        add_watched_dir(dirs, includes->getString(i)->getValue());
+    }
+}
+
+// Directories whose changes trigger a rebuild: sourceDir and the include
+// directories, of every target if there is a 'targets' section
+std::vector<std::string> watched_dirs(DragonConfig::CompoundEntry* buildConfig) {
+    std::vector<std::string> dirs;
+    DragonConfig::CompoundEntry* section = buildConfig->getCompound("targets");
+    if (section) {
+        for (auto&& entry : section->entries) {
+            if (entry->getType() == DragonConfig::EntryType::Compound) {
+                add_config_dirs(dirs, reinterpret_cast<DragonConfig::CompoundEntry*>(entry), buildConfig);
+            }
+        }
+    } else {
+        add_config_dirs(dirs, buildConfig, buildConfig);
+    }
+    for (auto&& include : customIncludes) {
+        add_watched_dir(dirs, include);
+    }
+    return dirs;
+}
+
+int cmd_watch(std::string& configFile) {
+#if defined(__linux__)
+    if (!std::filesystem::exists(configFile)) {
+        DRAGON_ERR << "Config file not found!" << std::endl;
+        DRAGON_ERR << "Have you forgot to run 'dragon init'?" << std::endl;
+        return 1;
+    }
+    DragonConfig::CompoundEntry* buildConfig = load_build_config(configFile);
+    if (!buildConfig) {
+        return 1;
+    }
+
+    FileWatcher watcher;
+    if (!watcher.open(configFile)) {
+        return 1;
+    }
+    std::vector<std::string> dirs = watched_dirs(buildConfig);
+    for (auto&& dir : dirs) {
+        watcher.add(dir, true);
+    }
+    std::string outputDir = std::filesystem::path(buildConfig->getStringOrDefault("outputDir", "build")->getValue()).lexically_normal().string();
+
+    // build state, including the file digests, stays in memory between builds
+    BuildDatabase db;
+    std::thread builder;
+    std::atomic<bool> building{false};
+    bool pending = true;
+    bool configChanged = false;
+    auto lastChange = std::chrono::steady_clock::now() - std::chrono::milliseconds(WATCH_DEBOUNCE_MS);
+
+    while (true) {
+        if (!building && builder.joinable()) {
+            builder.join();
+            if (!pending) {
+                DRAGON_LOG << "Watching for changes..." << std::endl;
+            }
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (pending && !building && now - lastChange >= std::chrono::milliseconds(WATCH_DEBOUNCE_MS)) {
+            pending = false;
+            if (configChanged) {
+                configChanged = false;
+                DragonConfig::CompoundEntry* reloaded = load_build_config(configFile);
+                if (reloaded) {
+                    buildConfig = reloaded;
+                    for (auto&& dir : watched_dirs(buildConfig)) {
+                        if (std::find(dirs.begin(), dirs.end(), dir) == dirs.end()) {
+                            dirs.push_back(dir);
+                            watcher.add(dir, true);
+                        }
+                    }
+                }
+            }
+            buildCancelled = false;
+            building = true;
+            builder = std::thread([&]() {
+                build_from_config(buildConfig, &db);
+                building = false;
+            });
+        }
+
+        // wake up for the end of the debounce period and to notice the build finishing
+        int timeout = building ? 50 : -1;
+        if (pending && !building) {
+            timeout = WATCH_DEBOUNCE_MS;
+        }
+        struct pollfd pfd = {watcher.fd, POLLIN, 0};
+        if (poll(&pfd, 1, timeout) <= 0) {
+            continue;
+        }
+
+        std::vector<std::string> changed;
+        for (auto&& path : watcher.read()) {
+            if (strstarts(path, outputDir + std::filesystem::path::preferred_separator) || path == outputDir) {
+                continue;
+            }
+            if (path == watcher.configPath) {
+                configChanged = true;
+            }
+            changed.push_back(path);
+        }
+        if (changed.empty()) {
+            continue;
+        }
+        pending = true;
+        lastChange = std::chrono::steady_clock::now();
+
+        if (building) {
+            // compiles whose inputs changed again would only produce stale objects
+            size_t killed = kill_processes([&](const std::string& outFile) {
+                // the builder thread may be replacing the record meanwhile
+                std::vector<std::string> deps;
+                {
+                    std::lock_guard<std::mutex> guard(db.lock);
+                    auto record = db.records.find(outFile);
+                    if (record == db.records.end()) {
+                        return false;
+                    }
+                    deps = record->second.deps;
+                }
+                for (auto&& dep : deps) {
+                    if (std::find(changed.begin(), changed.end(), std::filesystem::path(dep).lexically_normal().string()) != changed.end()) {
+                        return true;
+                    }
+                }
+                return false;
+            });
+            if (killed || configChanged) {
+                buildCancelled = true;
+            }
+        }
+    }
+#else
+    (void) configFile;
+    DRAGON_ERR << "'watch' is only supported on Linux" << std::endl;
+    return 1;
+#endif
+}
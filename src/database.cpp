@@ -0,0 +1,238 @@
+#include "dragon.hpp"
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// On-disk layout, all integers in host byte order:
+//   char[8]  magic "DRGNDB\0\0"
+//   u32      version
+//   u32      path count, then per path: u32 length, bytes
+//   u32      file count, then per file: u32 path, u64 size, i64 mtime, u64 digest
+//   u32      record count, then per record:
+//            u32 output, u64 command hash, u64 input digest, u32 duration ms,
+//            i32 exit status, u64 peak memory (since version 2),
+//            u32 dep count, u32 deps[dep count]
+// Paths are referenced by their index in the path table.
+// Version 1 databases are still read, their records have no peak memory.
+
+static const char DATABASE_MAGIC[8] = {'D', 'R', 'G', 'N', 'D', 'B', 0, 0};
+static const uint32_t DATABASE_VERSION = 2;
+
+struct DatabaseReader {
+    const unsigned char* data;
+    size_t size;
+    size_t offset = 0;
+
+    bool read(void* out, size_t len) {
+        if (this->size - this->offset < len) {
+            return false;
+        }
+        memcpy(out, this->data + this->offset, len);
+        this->offset += len;
+        return true;
+    }
+
+    template<typename T>
+    bool read(T& out) {
+        return this->read(&out, sizeof(T));
+    }
+
+    // whether count entries of at least entrySize bytes each can still follow
+    bool fits(uint32_t count, size_t entrySize) const {
+        return count <= (this->size - this->offset) / entrySize;
+    }
+};
+
+struct DatabaseWriter {
+    std::string data;
+
+    void write(const void* in, size_t len) {
+        this->data.append((const char*) in, len);
+    }
+
+    template<typename T>
+    void write(const T& in) {
+        this->write(&in, sizeof(T));
+    }
+};
+
+static bool parse_database(BuildDatabase* db, const unsigned char* data, size_t size) {
+    DatabaseReader in{data, size};
+    char magic[8];
+    uint32_t version;
+    if (!in.read(magic, sizeof(magic)) || memcmp(magic, DATABASE_MAGIC, sizeof(magic)) != 0) {
+        return false;
+    }
+    if (!in.read(version) || version < 1 || version > DATABASE_VERSION) {
+        return false;
+    }
+
+    uint32_t count;
+    // counts are checked against the bytes left before reserving, so a
+    // corrupt file is ignored instead of failing the allocation
+    if (!in.read(count) || !in.fits(count, sizeof(uint32_t))) {
+        return false;
+    }
+    std::vector<std::string> paths;
+    paths.reserve(count);
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t len;
+        if (!in.read(len) || in.size - in.offset < len) {
+            return false;
+        }
+        paths.emplace_back((const char*) in.data + in.offset, len);
+        in.offset += len;
+    }
+
+    if (!in.read(count)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t path;
+        FileState state;
+        if (!in.read(path) || !in.read(state.size) || !in.read(state.mtime) || !in.read(state.digest) || path >= paths.size()) {
+            return false;
+        }
+        db->files.files[paths[path]] = state;
+    }
+
+    if (!in.read(count)) {
+        return false;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t output;
+        uint32_t depCount;
+        BuildRecord record;
+        if (!in.read(output) || !in.read(record.commandHash) || !in.read(record.inputDigest) ||
+            !in.read(record.durationMs) || !in.read(record.exitStatus) || output >= paths.size()) {
+            return false;
+        }
+        if ((version >= 2 && !in.read(record.peakMemory)) || !in.read(depCount) || !in.fits(depCount, sizeof(uint32_t))) {
+            return false;
+        }
+        record.deps.reserve(depCount);
+        for (uint32_t j = 0; j < depCount; j++) {
+            uint32_t dep;
+            if (!in.read(dep) || dep >= paths.size()) {
+                return false;
+            }
+            record.deps.push_back(paths[dep]);
+        }
+        db->records[paths[output]] = record;
+    }
+    return true;
+}
+
+bool BuildDatabase::load(const std::string& path) {
+    this->records.clear();
+    this->files.files.clear();
+    bool ok = false;
+#if !defined(_WIN32)
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            ok = parse_database(this, (const unsigned char*) data, st.st_size);
+            munmap(data, st.st_size);
+        }
+    }
+    ::close(fd);
+#else
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    ok = parse_database(this, (const unsigned char*) data.data(), data.size());
+#endif
+    if (!ok) {
+        DRAGON_ERR << "Ignoring corrupt or outdated build database: " << path << std::endl;
+        this->records.clear();
+        this->files.files.clear();
+    }
+    return ok;
+}
+
+bool BuildDatabase::save(const std::string& path) {
+    std::lock_guard<std::mutex> guard(this->lock);
+    std::lock_guard<std::mutex> filesGuard(this->files.lock);
+
+    std::map<std::string, uint32_t> pathIndex;
+    std::vector<const std::string*> paths;
+    auto intern = [&](const std::string& p) {
+        auto inserted = pathIndex.emplace(p, (uint32_t) paths.size());
+        if (inserted.second) {
+            paths.push_back(&inserted.first->first);
+        }
+        return inserted.first->second;
+    };
+
+    DatabaseWriter body;
+    body.write((uint32_t) this->files.files.size());
+    for (auto&& file : this->files.files) {
+        body.write(intern(file.first));
+        body.write(file.second.size);
+        body.write(file.second.mtime);
+        body.write(file.second.digest);
+    }
+    body.write((uint32_t) this->records.size());
+    for (auto&& record : this->records) {
+        body.write(intern(record.first));
+        body.write(record.second.commandHash);
+        body.write(record.second.inputDigest);
+        body.write(record.second.durationMs);
+        body.write(record.second.exitStatus);
+        body.write(record.second.peakMemory);
+        body.write((uint32_t) record.second.deps.size());
+        for (auto&& dep : record.second.deps) {
+            body.write(intern(dep));
+        }
+    }
+
+    DatabaseWriter out;
+    out.write(DATABASE_MAGIC, sizeof(DATABASE_MAGIC));
+    out.write(DATABASE_VERSION);
+    out.write((uint32_t) paths.size());
+    for (auto&& p : paths) {
+        out.write((uint32_t) p->size());
+        out.write(p->data(), p->size());
+    }
+    out.data += body.data;
+
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream file(tmp, std::ios::binary);
+        if (!file) {
+            return false;
+        }
+        file.write(out.data.data(), out.data.size());
+        if (!file) {
+            return false;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp, path, ec);
+    if (ec) {
+        return false;
+    }
+    this->files.dirty = false;
+    return true;
+}
+
+BuildRecord* BuildDatabase::find(const std::string& output) {
+    std::lock_guard<std::mutex> guard(this->lock);
+    auto record = this->records.find(output);
+    return record == this->records.end() ? nullptr : &record->second;
+}
+
+void BuildDatabase::record(const std::string& output, const BuildRecord& record) {
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->records[output] = record;
+}
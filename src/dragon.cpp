@@ -56,6 +56,10 @@ void usage(std::string progName, std::ostream& sink) {
     sink << "  config    Show the current config" << std::endl;
     sink << "  presets   List the available presets" << std::endl;
     sink << "  package   Run the 'package' subcommand" << std::endl;
+    sink << "  cache     Run the 'cache' subcommand" << std::endl;
+    sink << "  daemon    Run the 'daemon' subcommand" << std::endl;
+    sink << "  watch     Build the project and rebuild it whenever its sources change" << std::endl;
+    sink << "  stats     Show the slowest units and build times from the build history" << std::endl;
     sink << std::endl;
     sink << "Options:" << std::endl;
     sink << "  -c, --config <path>         Path to config file" << std::endl;
@@ -79,7 +83,12 @@ void usage(std::string progName, std::ostream& sink) {
     sink << "  -preset <preset>            Use a preset for initialization (only works with the 'init' command)" << std::endl;
     sink << "  -conf <key>                 Use key as the root key for build configuration" << std::endl;
     sink << "  -fullRebuild                Ignore cache and rebuild everything" << std::endl;
-    sink << "  -noParallel                 Disable parallel compilation" << std::endl;
+    sink << "  -noParallel                 Disable parallel compilation (same as -j 1)" << std::endl;
+    sink << "  -j <jobs>                   Number of parallel compile jobs (default: available CPUs)" << std::endl;
+    sink << "  -n <count>                  Number of recent builds to show (only works with the 'stats' command)" << std::endl;
+    sink << "  -top <count>                Number of slowest units to show (only works with the 'stats' command)" << std::endl;
+    sink << "  -mem <size>                 Only start compiles while their recorded peak memory fits into size (e.g. 16G)" << std::endl;
+    sink << "  -trace <file>               Write a timeline of the build in Chrome trace format to file" << std::endl;
 }
 
 bool overrideCompiler = false;
@@ -94,6 +103,8 @@ bool overrideOutFilePrefix = false;
 
 bool fullRebuild = false;
 bool parallel = true;
+size_t jobs = 0;
+uint64_t memoryBudget = 0;
 
 std::string compiler = "gcc";
 std::string outputDir = "build";
@@ -141,6 +152,25 @@ std::vector<std::string> split(const std::string& str, char delim) {
     return tokens;
 }
 
+std::string find_program(const std::string& program) {
+    if (program.find(std::filesystem::path::preferred_separator) != std::string::npos) {
+        return std::filesystem::exists(program) ? program : "";
+    }
+    const char* path = getenv("PATH");
+#if defined(_WIN32)
+    char sep = ';';
+#else
+    char sep = ':';
+#endif
+    for (auto&& dir : split(path ? path : "", sep)) {
+        std::string candidate = dir + std::filesystem::path::preferred_separator + program;
+        if (std::filesystem::exists(candidate)) {
+            return candidate;
+        }
+    }
+    return "";
+}
+
 int main(int argc, const char* argv[])
 {
     signal(SIGSEGV, handle_signal);
@@ -167,9 +197,24 @@ int main(int argc, const char* argv[])
             args.push_back(std::string(argv[i]));
         }
         return pkg_install(args);
+    } else if (command == "cache") {
+        std::vector<std::string> args;
+        for (int i = 2; i < argc; ++i) {
+            args.push_back(std::string(argv[i]));
+        }
+        return cmd_cache(args);
+    } else if (command == "daemon") {
+        std::vector<std::string> args;
+        for (int i = 2; i < argc; ++i) {
+            args.push_back(std::string(argv[i]));
+        }
+        return cmd_daemon(args);
     }
 
     std::string key = "";
+    std::vector<std::string> options(argv + 2, argv + argc);
+    size_t statsBuilds = 10;
+    size_t statsUnits = 10;
 
     for (int i = 2; i < argc; ++i) {
         std::string arg = std::string(argv[i]);
@@ -327,10 +372,55 @@ int main(int argc, const char* argv[])
                 DRAGON_ERR << "No key specified" << std::endl;
                 exit(1);
             }
+        } else if ((arg == "-n" || arg == "-top") && command == "stats") {
+            if (i + 1 < argc) {
+                size_t count = std::strtoul(argv[++i], nullptr, 10);
+                if (count == 0) {
+                    DRAGON_ERR << "Invalid count: " << argv[i] << std::endl;
+                    exit(1);
+                }
+                (arg == "-n" ? statsBuilds : statsUnits) = count;
+            } else {
+                DRAGON_ERR << "No count specified" << std::endl;
+                exit(1);
+            }
         } else if (arg == "-fullRebuild") {
             fullRebuild = true;
         } else if (arg == "-noParallel") {
             parallel = false;
+        } else if (arg == "-j" || (strstarts(arg, "-j") && arg.find_first_not_of("0123456789", 2) == std::string::npos)) {
+            std::string count = arg.substr(2);
+            if (count.empty()) {
+                if (i + 1 < argc) {
+                    count = std::string(argv[++i]);
+                } else {
+                    DRAGON_ERR << "No job count specified" << std::endl;
+                    exit(1);
+                }
+            }
+            jobs = std::strtoul(count.c_str(), nullptr, 10);
+            if (jobs == 0) {
+                DRAGON_ERR << "Invalid job count: " << count << std::endl;
+                exit(1);
+            }
+        } else if (arg == "-mem") {
+            if (i + 1 < argc) {
+                memoryBudget = parse_size(argv[++i]);
+                if (memoryBudget == 0) {
+                    DRAGON_ERR << "Invalid memory size: " << argv[i] << std::endl;
+                    exit(1);
+                }
+            } else {
+                DRAGON_ERR << "No memory size specified" << std::endl;
+                exit(1);
+            }
+        } else if (arg == "-trace") {
+            if (i + 1 < argc) {
+                trace_start(std::string(argv[++i]));
+            } else {
+                DRAGON_ERR << "No trace file specified" << std::endl;
+                exit(1);
+            }
         } else if (arg == "-h" || arg == "--help") {
             usage(argv[0], std::cout);
             return 0;
@@ -344,7 +434,13 @@ int main(int argc, const char* argv[])
     if (command == "init") {
         cmd_init(buildConfigFile);
     } else if (command == "build") {
-        cmd_build(buildConfigFile);
+        int status;
+        if (!trace_enabled() && daemon_build(buildConfigFile, options, status)) {
+            return status;
+        }
+        if (cmd_build(buildConfigFile).empty()) {
+            return 1;
+        }
     } else if (command == "help") {
         usage(argv[0], std::cout);
     } else if (command == "version") {
@@ -353,6 +449,12 @@ int main(int argc, const char* argv[])
         cmd_run(buildConfigFile);
     } else if (command == "clean") {
         cmd_clean(buildConfigFile);
+    } else if (command == "serve") {
+        return cmd_serve(buildConfigFile, options);
+    } else if (command == "watch") {
+        return cmd_watch(buildConfigFile);
+    } else if (command == "stats") {
+        return cmd_stats(buildConfigFile, statsBuilds, statsUnits);
     } else if (command == "config") {
         DragonConfig::ConfigParser parser;
         DragonConfig::CompoundEntry* root = parser.parse(buildConfigFile);
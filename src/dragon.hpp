@@ -4,6 +4,8 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <map>
+#include <set>
 #include <filesystem>
 #include <fstream>
 #include <sstream>
@@ -11,8 +13,15 @@
 #include <thread>
 #include <functional>
 #include <chrono>
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <errno.h>
 #include <signal.h>
 #include <string.h>
@@ -53,6 +62,8 @@ extern bool overrideOutFilePrefix;
 
 extern bool fullRebuild;
 extern bool parallel;
+extern size_t jobs;
+extern uint64_t memoryBudget;
 
 extern std::string compiler;
 extern std::string outputDir;
@@ -77,7 +88,49 @@ extern std::vector<std::string> customPostBuilds;
 
 extern std::string buildConfigRootEntry;
 
+struct BuildDatabase;
+// set while a build should stop early because its inputs changed again
+extern std::atomic<bool> buildCancelled;
+
+#if defined(_WIN32)
+#define PRE_BUILD_TAG "preBuildWin"
+#define POST_BUILD_TAG "postBuildWin"
+#else
+#define PRE_BUILD_TAG "preBuild"
+#define POST_BUILD_TAG "postBuild"
+#endif
+
+struct BuildTarget;
+// session keeps the build database in memory across builds, see cmd_watch.
+// buildTarget is set while building one entry of a 'targets' section.
+std::string build_from_config(DragonConfig::CompoundEntry* buildConfig, BuildDatabase* session = nullptr, BuildTarget* buildTarget = nullptr);
+// builds every entry of the 'targets' section of buildConfig
+std::string build_targets(DragonConfig::CompoundEntry* buildConfig);
 std::string cmd_build(std::string& configFile, bool waitForInteract = false);
+int cmd_watch(std::string& configFile);
+int cmd_daemon(std::vector<std::string> args);
+int cmd_serve(std::string& configFile, const std::vector<std::string>& options);
+// sends the build to a running build server, false if there is none that can take it
+bool daemon_build(std::string& configFile, const std::vector<std::string>& options, int& status);
+
+// Reports changes below a set of directories and to the config file through
+// inotify, only available on Linux
+struct FileWatcher {
+    int fd = -1;
+    std::map<int, std::string> dirs;
+    // only the config file is of interest in the directory watched by configWd
+    int configWd = -1;
+    std::string configPath;
+
+    ~FileWatcher();
+    bool open(const std::string& configFile);
+    int add(const std::string& dir, bool recursive);
+    // reads the pending events, returns the changed paths
+    std::vector<std::string> read();
+};
+
+DragonConfig::CompoundEntry* load_build_config(std::string& configFile);
+std::vector<std::string> watched_dirs(DragonConfig::CompoundEntry* buildConfig);
 void cmd_init(std::string& configFile);
 void cmd_run(std::string& configFile);
 std::vector<std::string> get_presets();
@@ -86,11 +139,335 @@ void load_preset(std::string& identifier);
 void cmd_clean(std::string& configFile);
 int cmd_package(std::vector<std::string> args);
 int pkg_install(std::vector<std::string> args);
+int cmd_cache(std::vector<std::string> args);
+int cmd_stats(std::string& configFile, size_t buildCount, size_t unitCount);
 void run_with_args(std::string& cmd, std::vector<std::string>& args);
 
+struct ProcessUsage {
+    uint64_t cpuMs = 0;
+    uint64_t peakMemory = 0;
+};
+
+std::vector<std::string> split_command_line(const std::string& command);
+int spawn_process(const std::vector<std::string>& args, std::string* output = nullptr, size_t outputLimit = SIZE_MAX, ProcessUsage* usage = nullptr);
+void emit_job_output(const std::string& log, const std::string& diagnostics);
+// processes spawned by the calling thread are registered under tag until they exit
+void set_process_tag(const std::string& tag);
+size_t kill_processes(const std::function<bool(const std::string& tag)>& match);
+int run_command(const std::string& command);
+
+struct JobPool {
+    typedef std::function<void(size_t worker)> Job;
+
+    JobPool(size_t workerCount, uint64_t memoryBudget = 0);
+    ~JobPool();
+    // memory is the expected peak memory of the job, jobs only start while
+    // they fit into the budget next to the running ones
+    void submit(Job job, uint64_t memory = 0);
+    void wait();
+    size_t size() const;
+    // caps the number of jobs running at once, at most size()
+    void setLimit(size_t limit);
+    size_t getLimit();
+    size_t active();
+
+private:
+    struct QueuedJob {
+        Job job;
+        uint64_t memory;
+    };
+
+    struct Worker {
+        std::thread thread;
+        std::mutex lock;
+        std::deque<QueuedJob> queue;
+    };
+
+    std::vector<Worker*> workers;
+    std::atomic<size_t> nextWorker{0};
+    std::mutex stateLock;
+    std::condition_variable wakeup;
+    std::condition_variable done;
+    size_t queued = 0;
+    size_t pending = 0;
+    size_t running = 0;
+    size_t limit;
+    uint64_t memoryBudget;
+    uint64_t memoryInUse = 0;
+    bool stopping = false;
+
+    bool take(size_t index, QueuedJob& job, uint64_t memoryLeft);
+    void workerLoop(size_t index);
+};
+
+size_t default_job_count();
+
+// Counts the jobs of one build on a pool shared with other builds, so that
+// it can wait for its own jobs only
+struct JobGroup {
+    void add(size_t count = 1);
+    void done();
+    void wait();
+
+private:
+    std::mutex lock;
+    std::condition_variable finished;
+    size_t pending = 0;
+};
+
+// Walks root on the pool, visiting every regular file from any of its workers.
+// Directories for which prune returns true are not entered.
+void scan_directory(const std::string& root, JobPool& pool, const std::function<bool(const std::string& dir)>& prune, const std::function<void(const std::string& file)>& visit);
+
+// Shell style globbing on '/' separated relative paths: '*' and '?' stay
+// within one directory, '**' spans directories and [...] matches a class.
+bool glob_match(const std::string& pattern, const std::string& path);
+bool is_glob(const std::string& pattern);
+
+// Listing of every directory below root, kept between builds so that only
+// directories whose mtime changed have to be read again.
+struct DirectorySnapshot {
+    struct Dir {
+        int64_t mtime = 0;
+        std::vector<std::string> files;
+        std::vector<std::string> subdirs;
+    };
+    std::string root;
+    std::map<std::string, Dir> dirs;
+
+    bool load(const std::string& path);
+    bool save(const std::string& path);
+    // Returns the number of directories that had to be listed again
+    size_t refresh(const std::string& root, JobPool& pool, const std::function<bool(const std::string& dir)>& prune);
+    // All files relative to root, sorted
+    std::vector<std::string> files();
+};
+
+#define DRAGON_LOAD_SAMPLE_MS 500
+
+// Periodically narrows or widens the job limit of a pool between minJobs
+// and maxJobs based on the system load and the available memory
+struct LoadMonitor {
+    LoadMonitor(JobPool& pool, size_t minJobs, size_t maxJobs);
+    ~LoadMonitor();
+
+private:
+    JobPool& pool;
+    size_t minJobs;
+    size_t maxJobs;
+    std::thread thread;
+    std::mutex stateLock;
+    std::condition_variable wakeup;
+    bool stopping = false;
+
+    void run();
+    void adjust();
+};
+
+struct FileState {
+    uint64_t size;
+    int64_t mtime;
+    uint64_t digest;
+};
+
+struct FileHashCache {
+    std::map<std::string, FileState> files;
+    std::mutex lock;
+    bool dirty = false;
+
+    bool digest(const std::string& path, uint64_t& digest);
+    bool digestAll(const std::vector<std::string>& paths, uint64_t& digest);
+};
+
+struct BuildRecord {
+    uint64_t commandHash = 0;
+    uint64_t inputDigest = 0;
+    uint32_t durationMs = 0;
+    int32_t exitStatus = 0;
+    uint64_t peakMemory = 0;
+    std::vector<std::string> deps;
+};
+
+// Persistent per-output build state kept in <outputDir>/build.drg.db
+struct BuildDatabase {
+    std::map<std::string, BuildRecord> records;
+    FileHashCache files;
+    std::mutex lock;
+
+    bool load(const std::string& path);
+    bool save(const std::string& path);
+    BuildRecord* find(const std::string& output);
+    void record(const std::string& output, const BuildRecord& record);
+};
+
+#define DRAGON_CACHE_MAX_SIZE   "5G"
+#define DRAGON_JOB_OUTPUT_LIMIT "1M"
+
+struct ObjectCache {
+    std::string dir;
+    uint64_t maxSize;
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> bytesServed{0};
+    std::atomic<uint64_t> timeSavedMs{0};
+    std::atomic<uint64_t> bytesStored{0};
+
+    ObjectCache(const std::string& dir, uint64_t maxSize);
+    bool lookup(uint64_t key, FileHashCache& hashes, const std::string& outFile, std::vector<std::string>& deps, std::string& diagnostics);
+    void store(uint64_t key, FileHashCache& hashes, const std::string& outFile, const std::vector<std::string>& deps, const std::string& diagnostics, uint64_t durationMs);
+    void flush();
+    std::map<std::string, uint64_t> readStats();
+
+private:
+    struct ManifestEntry {
+        uint64_t result;
+        std::vector<std::string> deps;
+        std::vector<uint64_t> digests;
+    };
+
+    std::mutex manifestLock;
+
+    std::string path(const std::string& kind, uint64_t key, const std::string& extension);
+    std::vector<ManifestEntry> readManifest(uint64_t key);
+    uint64_t evict(uint64_t targetSize);
+};
+
+// Timeline of a build in Chrome trace event format, enabled with -trace <file>
+struct TraceSpan {
+    TraceSpan(const std::string& name, const std::string& category, size_t track = 0);
+    ~TraceSpan();
+    void arg(const std::string& key, const std::string& value);
+    void end();
+
+private:
+    std::string name;
+    std::string category;
+    size_t track;
+    uint64_t start = 0;
+    bool ended = false;
+    std::vector<std::pair<std::string, std::string>> args;
+};
+
+void trace_start(const std::string& file);
+bool trace_enabled();
+void trace_name_track(size_t track, const std::string& name);
+void trace_write();
+
+#define DRAGON_HISTORY_MAX_SIZE (4 * 1024 * 1024)
+
+struct HistoryEntry {
+    std::string kind;
+    std::string output;
+    uint64_t wallMs;
+    uint64_t cpuMs;
+    int exitStatus;
+};
+
+// Timings of one build as kept in <outputDir>/build.drg.history
+struct HistoryBuild {
+    int64_t timestamp = 0;
+    uint64_t wallMs = 0;
+    uint64_t jobs = 0;
+    std::vector<HistoryEntry> entries;
+};
+
+std::vector<HistoryBuild> history_load(const std::string& path);
+bool history_append(const std::string& path, const HistoryBuild& build);
+
+struct TargetGraph;
+
+struct BuildTarget {
+    std::string name;
+    std::string type;
+    DragonConfig::CompoundEntry* config = nullptr;
+    std::vector<BuildTarget*> deps;
+    TargetGraph* graph = nullptr;
+    size_t index = 0;
+    bool finished = false;
+    std::string output;
+
+    // Targets plan their builds one at a time in dependency order, their
+    // compiles and links run concurrently
+    void waitForTurn();
+    void finishTurn();
+    // Waits for all dependencies, false if one of them failed
+    bool waitForDeps();
+    // Libraries this target links against, dependents first
+    std::vector<BuildTarget*> libraries();
+    // Whether a shared library target links this one, its objects then
+    // have to be position independent
+    bool linkedIntoShared();
+};
+
+// State shared by the targets of one 'targets' section. All their compiles
+// run on one pool and units with identical commands share one object in
+// objectDir, compiled by whichever target submits it first.
+struct TargetGraph {
+    struct SharedObject {
+        bool done = false;
+        int exitStatus = -1;
+        BuildRecord record;
+        // called once the object is done, with its exit status
+        std::vector<std::function<void(int exitStatus, const BuildRecord& record)>> waiters;
+    };
+
+    JobPool* pool = nullptr;
+    std::string objectDir;
+    std::map<std::string, BuildTarget> targets;
+    std::map<std::string, SharedObject> objects;
+    std::mutex lock;
+    std::condition_variable changed;
+    // index of the target allowed to plan its build
+    size_t turn = 0;
+
+    // Returns false when outFile was already claimed by another target, in
+    // which case waiter runs once it is done
+    bool claim(const std::string& outFile, const std::function<void(int exitStatus, const BuildRecord& record)>& waiter);
+    void publish(const std::string& outFile, int exitStatus, const BuildRecord& record);
+};
+
+// Holds the planning turn of a target until released or destroyed
+struct TargetTurn {
+    BuildTarget* target;
+
+    TargetTurn(BuildTarget* target);
+    ~TargetTurn();
+    void release();
+};
+
+bool scan_todos(const std::string& path, std::vector<std::string>& todos);
+
+// Cached to-do marker scan results per file content, kept in <outputDir>/build.drg.todos
+struct TodoCache {
+    std::map<uint64_t, std::vector<std::string>> files;
+    std::set<uint64_t> used;
+    std::mutex lock;
+    bool dirty = false;
+
+    bool load(const std::string& path);
+    bool save(const std::string& path);
+    // Only reads the file when no todos are cached for its digest
+    bool scan(const std::string& path, FileHashCache& hashes, std::vector<std::string>& todos);
+};
+
+std::string default_cache_dir();
+uint64_t parse_size(const std::string& str);
+std::string compiler_identity(const std::string& compiler);
+
+uint64_t hash_bytes(const void* data, size_t len, uint64_t seed = 0);
+uint64_t hash_string(const std::string& str, uint64_t seed = 0);
+bool hash_file(const std::string& path, uint64_t& digest);
+std::string hash_to_string(uint64_t digest);
+bool file_stat(const std::string& path, uint64_t& size, int64_t& mtime);
+// Digest of the symbols a shared library exports, false if it is no ELF file
+bool shared_library_digest(const std::string& path, uint64_t& digest);
+
 std::string replaceAll(std::string src, std::string from, std::string to);
 bool strstarts(const std::string& str, const std::string& prefix);
+bool strendswith(const std::string& str, const std::string& suffix);
 std::vector<std::string> split(const std::string& str, char delim);
+// Path of program, looked up in PATH unless it has a directory, empty if not found
+std::string find_program(const std::string& program);
 std::filesystem::file_time_type file_modified_time(const std::string& path);
 
 #endif
@@ -0,0 +1,108 @@
+#include "dragon.hpp"
+
+#if defined(__linux__)
+#include <elf.h>
+#include <endian.h>
+
+template<typename Ehdr, typename Shdr, typename Sym, typename Dyn>
+static bool digest_dynsym(std::ifstream& file, uint64_t& digest) {
+    Ehdr header;
+    if (!file.seekg(0) || !file.read((char*) &header, sizeof(header)) || header.e_shentsize != sizeof(Shdr)) {
+        return false;
+    }
+    std::vector<Shdr> sections(header.e_shnum);
+    if (!file.seekg(header.e_shoff) || !file.read((char*) sections.data(), sections.size() * sizeof(Shdr))) {
+        return false;
+    }
+
+    // dependents record the soname as their DT_NEEDED entry, a new one needs a relink
+    std::string soname;
+    for (auto&& section : sections) {
+        if (section.sh_type != SHT_DYNAMIC || section.sh_entsize != sizeof(Dyn) || section.sh_link >= sections.size()) {
+            continue;
+        }
+        std::vector<Dyn> entries(section.sh_size / sizeof(Dyn));
+        const Shdr& stringSection = sections[section.sh_link];
+        std::string strings(stringSection.sh_size, '\0');
+        if (!file.seekg(section.sh_offset) || !file.read((char*) entries.data(), entries.size() * sizeof(Dyn)) ||
+            !file.seekg(stringSection.sh_offset) || !file.read(&strings[0], strings.size())) {
+            return false;
+        }
+        for (auto&& entry : entries) {
+            if (entry.d_tag == DT_SONAME && entry.d_un.d_val < strings.size()) {
+                soname = strings.c_str() + entry.d_un.d_val;
+            }
+        }
+    }
+
+    for (auto&& section : sections) {
+        if (section.sh_type != SHT_DYNSYM || section.sh_entsize != sizeof(Sym) || section.sh_link >= sections.size()) {
+            continue;
+        }
+        std::vector<Sym> symbols(section.sh_size / sizeof(Sym));
+        const Shdr& stringSection = sections[section.sh_link];
+        std::string strings(stringSection.sh_size, '\0');
+        if (!file.seekg(section.sh_offset) || !file.read((char*) symbols.data(), symbols.size() * sizeof(Sym)) ||
+            !file.seekg(stringSection.sh_offset) || !file.read(&strings[0], strings.size())) {
+            return false;
+        }
+
+        // only what other binaries can bind to: defined, global and visible
+        std::vector<std::string> exported;
+        for (auto&& symbol : symbols) {
+            unsigned char binding = symbol.st_info >> 4;
+            unsigned char type = symbol.st_info & 0xf;
+            unsigned char visibility = symbol.st_other & 0x3;
+            if (symbol.st_shndx == SHN_UNDEF || symbol.st_name >= strings.size() ||
+                (binding != STB_GLOBAL && binding != STB_WEAK && binding != STB_GNU_UNIQUE) ||
+                (visibility != STV_DEFAULT && visibility != STV_PROTECTED)) {
+                continue;
+            }
+            std::string entry = strings.c_str() + symbol.st_name;
+            entry += " " + std::to_string(type) + " " + std::to_string(binding);
+            // the layout of exported data is part of the ABI, code size is not
+            if (type == STT_OBJECT || type == STT_TLS) {
+                entry += " " + std::to_string(symbol.st_size);
+            }
+            exported.push_back(entry);
+        }
+        std::sort(exported.begin(), exported.end());
+        digest = hash_string(soname);
+        for (auto&& entry : exported) {
+            digest = hash_string(entry, digest);
+        }
+        return true;
+    }
+    return false;
+}
+#endif
+
+bool shared_library_digest(const std::string& path, uint64_t& digest) {
+#if defined(__linux__)
+    std::ifstream file(path, std::ios::binary);
+    unsigned char ident[EI_NIDENT];
+    if (!file.read((char*) ident, sizeof(ident)) || memcmp(ident, ELFMAG, SELFMAG) != 0) {
+        return false;
+    }
+    // section headers are read as they are, so only native byte order
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+    if (ident[EI_DATA] != ELFDATA2LSB) {
+        return false;
+    }
+#else
+    if (ident[EI_DATA] != ELFDATA2MSB) {
+        return false;
+    }
+#endif
+    if (ident[EI_CLASS] == ELFCLASS64) {
+        return digest_dynsym<Elf64_Ehdr, Elf64_Shdr, Elf64_Sym, Elf64_Dyn>(file, digest);
+    } else if (ident[EI_CLASS] == ELFCLASS32) {
+        return digest_dynsym<Elf32_Ehdr, Elf32_Shdr, Elf32_Sym, Elf32_Dyn>(file, digest);
+    }
+    return false;
+#else
+    (void) path;
+    (void) digest;
+    return false;
+#endif
+}
@@ -0,0 +1,168 @@
+#include "dragon.hpp"
+
+// XXH64, see https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+static const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t read32(const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input) {
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t merge64(uint64_t acc, uint64_t val) {
+    acc ^= round64(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t hash_bytes(const void* data, size_t len, uint64_t seed) {
+    const unsigned char* p = (const unsigned char*) data;
+    const unsigned char* end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+        uint64_t v2 = seed + PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME64_1;
+        const unsigned char* limit = end - 32;
+        do {
+            v1 = round64(v1, read64(p));
+            v2 = round64(v2, read64(p + 8));
+            v3 = round64(v3, read64(p + 16));
+            v4 = round64(v4, read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = merge64(h, v1);
+        h = merge64(h, v2);
+        h = merge64(h, v3);
+        h = merge64(h, v4);
+    } else {
+        h = seed + PRIME64_5;
+    }
+
+    h += (uint64_t) len;
+
+    while (p + 8 <= end) {
+        h ^= round64(0, read64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t) read32(p) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p) * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t hash_string(const std::string& str, uint64_t seed) {
+    return hash_bytes(str.data(), str.size(), seed);
+}
+
+bool hash_file(const std::string& path, uint64_t& digest) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    digest = hash_string(data);
+    return true;
+}
+
+std::string hash_to_string(uint64_t digest) {
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long) digest);
+    return std::string(buf);
+}
+
+bool file_stat(const std::string& path, uint64_t& size, int64_t& mtime) {
+#if !defined(_WIN32)
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        return false;
+    }
+    size = st.st_size;
+#if defined(__APPLE__)
+    mtime = (int64_t) st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    mtime = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+    return true;
+#else
+    std::error_code ec;
+    size = std::filesystem::file_size(path, ec);
+    if (ec) {
+        return false;
+    }
+    mtime = std::filesystem::last_write_time(path, ec).time_since_epoch().count();
+    return !ec;
+#endif
+}
+
+bool FileHashCache::digest(const std::string& path, uint64_t& digest) {
+    uint64_t size;
+    int64_t mtime;
+    if (!file_stat(path, size, mtime)) {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        auto state = this->files.find(path);
+        if (state != this->files.end() && state->second.size == size && state->second.mtime == mtime) {
+            digest = state->second.digest;
+            return true;
+        }
+    }
+    // only read the file when its size or modification time changed
+    if (!hash_file(path, digest)) {
+        return false;
+    }
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->files[path] = FileState{size, mtime, digest};
+    this->dirty = true;
+    return true;
+}
+
+bool FileHashCache::digestAll(const std::vector<std::string>& paths, uint64_t& digest) {
+    digest = 0;
+    for (auto&& path : paths) {
+        uint64_t fileDigest;
+        if (!this->digest(path, fileDigest)) {
+            return false;
+        }
+        digest = hash_string(path, digest ^ fileDigest);
+    }
+    return true;
+}
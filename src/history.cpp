@@ -0,0 +1,80 @@
+#include "dragon.hpp"
+
+// Text file with one line per build followed by one line per compile or link
+// run during that build, fields separated by tabs:
+//   build   <unix time> <compile phase wall ms> <jobs>
+//   compile <wall ms> <cpu ms> <exit status> <output>
+//   link    <wall ms> <cpu ms> <exit status> <output>
+// New builds are appended, the oldest ones are dropped once the file grows
+// past DRAGON_HISTORY_MAX_SIZE.
+
+static void write_build(std::ostream& out, const HistoryBuild& build) {
+    out << "build\t" << build.timestamp << "\t" << build.wallMs << "\t" << build.jobs << "\n";
+    for (auto&& entry : build.entries) {
+        out << entry.kind << "\t" << entry.wallMs << "\t" << entry.cpuMs << "\t" << entry.exitStatus << "\t" << entry.output << "\n";
+    }
+}
+
+std::vector<HistoryBuild> history_load(const std::string& path) {
+    std::vector<HistoryBuild> builds;
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+        std::vector<std::string> fields = split(line, '\t');
+        if (fields.size() == 4 && fields[0] == "build") {
+            builds.emplace_back();
+            builds.back().timestamp = std::strtoll(fields[1].c_str(), nullptr, 10);
+            builds.back().wallMs = std::strtoull(fields[2].c_str(), nullptr, 10);
+            builds.back().jobs = std::strtoull(fields[3].c_str(), nullptr, 10);
+        } else if (fields.size() == 5 && builds.size()) {
+            builds.back().entries.push_back(HistoryEntry{
+                fields[0],
+                fields[4],
+                std::strtoull(fields[1].c_str(), nullptr, 10),
+                std::strtoull(fields[2].c_str(), nullptr, 10),
+                (int) std::strtol(fields[3].c_str(), nullptr, 10)
+            });
+        }
+    }
+    return builds;
+}
+
+bool history_append(const std::string& path, const HistoryBuild& build) {
+    {
+        std::ofstream file(path, std::ios::app);
+        if (!file) {
+            return false;
+        }
+        write_build(file, build);
+    }
+
+    std::error_code ec;
+    if (std::filesystem::file_size(path, ec) <= DRAGON_HISTORY_MAX_SIZE || ec) {
+        return true;
+    }
+    // keep the newest builds that fit into half the limit
+    std::vector<HistoryBuild> builds = history_load(path);
+    std::vector<std::string> kept;
+    size_t size = 0;
+    for (size_t i = builds.size(); i > 0; i--) {
+        std::stringstream out;
+        write_build(out, builds[i - 1]);
+        size += out.str().size();
+        if (size > DRAGON_HISTORY_MAX_SIZE / 2 && kept.size()) {
+            break;
+        }
+        kept.push_back(out.str());
+    }
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream file(tmp);
+        if (!file) {
+            return false;
+        }
+        for (size_t i = kept.size(); i > 0; i--) {
+            file << kept[i - 1];
+        }
+    }
+    std::filesystem::rename(tmp, path, ec);
+    return !ec;
+}
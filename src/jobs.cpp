@@ -0,0 +1,334 @@
+#include "dragon.hpp"
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+static thread_local JobPool* currentPool = nullptr;
+static thread_local size_t currentWorker = 0;
+
+JobPool::JobPool(size_t workerCount, uint64_t memoryBudget) {
+    if (workerCount == 0) {
+        workerCount = 1;
+    }
+    this->limit = workerCount;
+    this->memoryBudget = memoryBudget;
+    this->workers.reserve(workerCount);
+    for (size_t i = 0; i < workerCount; i++) {
+        this->workers.push_back(new Worker());
+    }
+    for (size_t i = 0; i < workerCount; i++) {
+        this->workers[i]->thread = std::thread(&JobPool::workerLoop, this, i);
+    }
+}
+
+JobPool::~JobPool() {
+    {
+        std::lock_guard<std::mutex> lock(this->stateLock);
+        this->stopping = true;
+    }
+    this->wakeup.notify_all();
+    for (auto worker : this->workers) {
+        worker->thread.join();
+        delete worker;
+    }
+}
+
+size_t JobPool::size() const {
+    return this->workers.size();
+}
+
+void JobPool::setLimit(size_t limit) {
+    {
+        std::lock_guard<std::mutex> lock(this->stateLock);
+        this->limit = std::max<size_t>(1, std::min(limit, this->workers.size()));
+    }
+    this->wakeup.notify_all();
+}
+
+size_t JobPool::getLimit() {
+    std::lock_guard<std::mutex> lock(this->stateLock);
+    return this->limit;
+}
+
+size_t JobPool::active() {
+    std::lock_guard<std::mutex> lock(this->stateLock);
+    return this->running;
+}
+
+void JobPool::submit(Job job, uint64_t memory) {
+    // jobs submitted from inside a job stay on the submitting worker,
+    // everything else is spread round-robin and balanced by stealing
+    size_t index;
+    if (currentPool == this) {
+        index = currentWorker;
+    } else {
+        index = this->nextWorker++ % this->workers.size();
+    }
+    {
+        std::lock_guard<std::mutex> lock(this->stateLock);
+        {
+            std::lock_guard<std::mutex> workerLock(this->workers[index]->lock);
+            this->workers[index]->queue.push_back(QueuedJob{std::move(job), memory});
+        }
+        this->queued++;
+        this->pending++;
+    }
+    this->wakeup.notify_one();
+}
+
+void JobPool::wait() {
+    std::unique_lock<std::mutex> lock(this->stateLock);
+    this->done.wait(lock, [this]() { return this->pending == 0; });
+}
+
+// Takes the first job that fits into memoryLeft, front to back from the
+// worker's own queue, back to front from the others
+bool JobPool::take(size_t index, QueuedJob& job, uint64_t memoryLeft) {
+    {
+        Worker* own = this->workers[index];
+        std::lock_guard<std::mutex> lock(own->lock);
+        for (auto it = own->queue.begin(); it != own->queue.end(); ++it) {
+            if (it->memory <= memoryLeft) {
+                job = std::move(*it);
+                own->queue.erase(it);
+                return true;
+            }
+        }
+    }
+    for (size_t i = 1; i < this->workers.size(); i++) {
+        Worker* victim = this->workers[(index + i) % this->workers.size()];
+        std::lock_guard<std::mutex> lock(victim->lock);
+        for (auto it = victim->queue.rbegin(); it != victim->queue.rend(); ++it) {
+            if (it->memory <= memoryLeft) {
+                job = std::move(*it);
+                victim->queue.erase(std::next(it).base());
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void JobPool::workerLoop(size_t index) {
+    currentPool = this;
+    currentWorker = index;
+    while (true) {
+        // jobs are taken under the state lock so the running count and the
+        // memory in use always match what has been admitted
+        QueuedJob job;
+        {
+            std::unique_lock<std::mutex> lock(this->stateLock);
+            while (true) {
+                if (this->stopping && this->queued == 0) {
+                    return;
+                }
+                // a job that exceeds the budget on its own still runs once nothing else does
+                uint64_t memoryLeft = UINT64_MAX;
+                if (this->memoryBudget && this->running) {
+                    memoryLeft = this->memoryBudget - std::min(this->memoryBudget, this->memoryInUse);
+                }
+                if (this->queued > 0 && this->running < this->limit && this->take(index, job, memoryLeft)) {
+                    break;
+                }
+                this->wakeup.wait(lock);
+            }
+            this->queued--;
+            this->running++;
+            this->memoryInUse += job.memory;
+        }
+        job.job(index);
+        bool finished;
+        {
+            std::lock_guard<std::mutex> lock(this->stateLock);
+            this->running--;
+            this->memoryInUse -= job.memory;
+            finished = --this->pending == 0;
+        }
+        // the freed memory may admit more than one waiting job
+        this->wakeup.notify_all();
+        if (finished) {
+            this->done.notify_all();
+        }
+    }
+}
+
+#if defined(__linux__)
+// Returns the number of CPUs granted by the cgroup CPU quota, or 0 if unlimited
+static size_t cgroup_cpu_limit() {
+    double quota = -1;
+    double period = 0;
+    std::ifstream v2("/sys/fs/cgroup/cpu.max");
+    if (v2) {
+        std::string max;
+        v2 >> max >> period;
+        if (max != "max") {
+            quota = std::atof(max.c_str());
+        }
+    } else {
+        std::ifstream quotaFile("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+        std::ifstream periodFile("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+        if (quotaFile && periodFile) {
+            quotaFile >> quota;
+            periodFile >> period;
+        }
+    }
+    if (quota <= 0 || period <= 0) {
+        return 0;
+    }
+    size_t cpus = (size_t) ((quota + period - 1) / period);
+    return cpus ? cpus : 1;
+}
+#endif
+
+size_t default_job_count() {
+    size_t count = std::thread::hardware_concurrency();
+#if defined(__linux__)
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        size_t affinity = CPU_COUNT(&set);
+        if (affinity && (count == 0 || affinity < count)) {
+            count = affinity;
+        }
+    }
+    size_t quota = cgroup_cpu_limit();
+    if (quota && (count == 0 || quota < count)) {
+        count = quota;
+    }
+#endif
+    return count ? count : 1;
+}
+
+// Memory the build may still use, the smaller of what the system and the
+// cgroup memory limit allow
+static bool read_memory(uint64_t& available, uint64_t& total) {
+#if defined(__linux__)
+    available = 0;
+    total = 0;
+    std::ifstream meminfo("/proc/meminfo");
+    std::string key;
+    uint64_t value;
+    std::string unit;
+    while (meminfo >> key >> value >> unit) {
+        if (key == "MemTotal:") {
+            total = value * 1024;
+        } else if (key == "MemAvailable:") {
+            available = value * 1024;
+        }
+    }
+    if (total == 0) {
+        return false;
+    }
+    uint64_t limit = 0;
+    uint64_t usage = 0;
+    std::ifstream maxFile("/sys/fs/cgroup/memory.max");
+    std::ifstream currentFile("/sys/fs/cgroup/memory.current");
+    if (maxFile && currentFile) {
+        std::string max;
+        maxFile >> max;
+        if (max != "max") {
+            limit = std::strtoull(max.c_str(), nullptr, 10);
+        }
+        currentFile >> usage;
+    } else {
+        std::ifstream limitFile("/sys/fs/cgroup/memory/memory.limit_in_bytes");
+        std::ifstream usageFile("/sys/fs/cgroup/memory/memory.usage_in_bytes");
+        if (limitFile && usageFile) {
+            limitFile >> limit;
+            usageFile >> usage;
+        }
+    }
+    if (limit && limit < total) {
+        total = limit;
+        available = std::min(available, limit > usage ? limit - usage : 0);
+    }
+    return true;
+#else
+    (void) available;
+    (void) total;
+    return false;
+#endif
+}
+
+static bool read_load(double& load) {
+#if defined(__linux__)
+    std::ifstream loadavg("/proc/loadavg");
+    return (bool) (loadavg >> load);
+#elif !defined(_WIN32)
+    return getloadavg(&load, 1) == 1;
+#else
+    (void) load;
+    return false;
+#endif
+}
+
+LoadMonitor::LoadMonitor(JobPool& pool, size_t minJobs, size_t maxJobs)
+    : pool(pool), minJobs(std::max<size_t>(1, minJobs)), maxJobs(std::max(minJobs, maxJobs)) {
+    this->adjust();
+    this->thread = std::thread(&LoadMonitor::run, this);
+}
+
+LoadMonitor::~LoadMonitor() {
+    {
+        std::lock_guard<std::mutex> lock(this->stateLock);
+        this->stopping = true;
+    }
+    this->wakeup.notify_all();
+    this->thread.join();
+}
+
+void LoadMonitor::run() {
+    std::unique_lock<std::mutex> lock(this->stateLock);
+    while (!this->wakeup.wait_for(lock, std::chrono::milliseconds(DRAGON_LOAD_SAMPLE_MS), [this]() { return this->stopping; })) {
+        this->adjust();
+    }
+}
+
+void LoadMonitor::adjust() {
+    size_t current = this->pool.getLimit();
+    size_t active = this->pool.active();
+    size_t target = this->maxJobs;
+
+    // leave the CPUs busy with other work alone, the load average
+    // includes our own compiles so those are taken out again
+    double load;
+    if (read_load(load)) {
+        double others = std::max(0.0, load - active);
+        double idle = (double) default_job_count() - others;
+        target = std::min(target, (size_t) std::max(0.0, idle + 0.5));
+    }
+
+    // back off one job at a time while memory is tight, hold steady until
+    // there is some headroom again
+    uint64_t available;
+    uint64_t total;
+    if (read_memory(available, total)) {
+        if (available < total / 10) {
+            target = std::min(target, active > 1 ? active - 1 : 1);
+        } else if (available < total / 5) {
+            target = std::min(target, std::max(current, active));
+        }
+    }
+
+    target = std::max(this->minJobs, std::min(target, this->maxJobs));
+    if (target != current) {
+        this->pool.setLimit(target);
+    }
+}
+
+void JobGroup::add(size_t count) {
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->pending += count;
+}
+
+void JobGroup::done() {
+    std::lock_guard<std::mutex> guard(this->lock);
+    if (--this->pending == 0) {
+        this->finished.notify_all();
+    }
+}
+
+void JobGroup::wait() {
+    std::unique_lock<std::mutex> lock(this->lock);
+    this->finished.wait(lock, [this]() { return this->pending == 0; });
+}
@@ -0,0 +1,258 @@
+#include "dragon.hpp"
+
+#if !defined(_WIN32)
+#include <spawn.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+extern char** environ;
+#endif
+
+#define SHELL_PREFIX "shell:"
+
+// running children by the tag of the thread that spawned them
+static std::mutex runningLock;
+static std::map<int, std::string> runningProcesses;
+static thread_local std::string processTag;
+
+void set_process_tag(const std::string& tag) {
+    processTag = tag;
+}
+
+size_t kill_processes(const std::function<bool(const std::string& tag)>& match) {
+    size_t killed = 0;
+#if !defined(_WIN32)
+    std::lock_guard<std::mutex> guard(runningLock);
+    for (auto&& process : runningProcesses) {
+        if (match(process.second) && kill(process.first, SIGTERM) == 0) {
+            killed++;
+        }
+    }
+#else
+    (void) match;
+#endif
+    return killed;
+}
+
+// Splits a command line into arguments, honouring single and double quotes
+// and backslash escapes the way a POSIX shell would for plain words
+std::vector<std::string> split_command_line(const std::string& command) {
+    std::vector<std::string> args;
+    std::string current;
+    bool inWord = false;
+    char quote = 0;
+    for (size_t i = 0; i < command.size(); i++) {
+        char c = command[i];
+        if (quote) {
+            if (c == quote) {
+                quote = 0;
+            } else if (c == '\\' && quote == '"' && i + 1 < command.size() && (command[i + 1] == '"' || command[i + 1] == '\\')) {
+                current += command[++i];
+            } else {
+                current += c;
+            }
+        } else if (c == '"' || c == '\'') {
+            quote = c;
+            inWord = true;
+        } else if (c == '\\' && i + 1 < command.size()) {
+            current += command[++i];
+            inWord = true;
+        } else if (isspace(c)) {
+            if (inWord) {
+                args.push_back(current);
+                current.clear();
+                inWord = false;
+            }
+        } else {
+            current += c;
+            inWord = true;
+        }
+    }
+    if (inWord) {
+        args.push_back(current);
+    }
+    return args;
+}
+
+#if defined(_WIN32)
+static std::string quote_argument(const std::string& arg) {
+    if (arg.size() && arg.find_first_of(" \t\"") == std::string::npos) {
+        return arg;
+    }
+    return "\"" + replaceAll(arg, "\"", "\\\"") + "\"";
+}
+#endif
+
+#if !defined(_WIN32)
+// pipes must not leak into processes spawned concurrently by other jobs,
+// otherwise the reader only sees EOF once those have exited as well
+static bool cloexec_pipe(int fds[2]) {
+#if defined(__linux__)
+    return pipe2(fds, O_CLOEXEC) == 0;
+#else
+    if (pipe(fds) != 0) {
+        return false;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return true;
+#endif
+}
+#endif
+
+int spawn_process(const std::vector<std::string>& args, std::string* output, size_t outputLimit, ProcessUsage* usage) {
+    if (args.empty()) {
+        return -1;
+    }
+#if !defined(_WIN32)
+    std::vector<char*> argv;
+    argv.reserve(args.size() + 1);
+    for (auto&& arg : args) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    int fds[2] = {-1, -1};
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (output) {
+        if (!cloexec_pipe(fds)) {
+            posix_spawn_file_actions_destroy(&actions);
+            return -1;
+        }
+        posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, fds[1], STDERR_FILENO);
+    }
+
+    pid_t pid;
+    int err = posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (output) {
+        close(fds[1]);
+    }
+    if (err != 0) {
+        if (output) {
+            close(fds[0]);
+        }
+        DRAGON_ERR << "Failed to run " << args.front() << ": " << strerror(err) << std::endl;
+        return 127;
+    }
+    if (processTag.size()) {
+        std::lock_guard<std::mutex> guard(runningLock);
+        runningProcesses[pid] = processTag;
+    }
+
+    if (output) {
+        // keep draining the pipe past the limit so the child never blocks on a full pipe
+        char buf[4096];
+        ssize_t n;
+        size_t dropped = 0;
+        while ((n = read(fds[0], buf, sizeof(buf))) != 0) {
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            size_t keep = std::min((size_t) n, outputLimit - std::min(outputLimit, output->size()));
+            output->append(buf, keep);
+            dropped += n - keep;
+        }
+        close(fds[0]);
+        if (dropped) {
+            *output += "\n[Dragon] Output truncated, " + std::to_string(dropped) + " bytes dropped\n";
+        }
+    }
+
+    int status;
+    struct rusage rusage;
+    int waited;
+    while ((waited = wait4(pid, &status, 0, &rusage)) < 0 && errno == EINTR) {
+    }
+    if (processTag.size()) {
+        std::lock_guard<std::mutex> guard(runningLock);
+        runningProcesses.erase(pid);
+    }
+    if (waited < 0) {
+        return -1;
+    }
+    if (usage) {
+        usage->cpuMs = (uint64_t) (rusage.ru_utime.tv_sec + rusage.ru_stime.tv_sec) * 1000 +
+                       (rusage.ru_utime.tv_usec + rusage.ru_stime.tv_usec) / 1000;
+#if defined(__APPLE__)
+        usage->peakMemory = rusage.ru_maxrss;
+#else
+        // kilobytes everywhere but on macOS
+        usage->peakMemory = (uint64_t) rusage.ru_maxrss * 1024;
+#endif
+    }
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return -1;
+#else
+    std::string command;
+    for (auto&& arg : args) {
+        command += quote_argument(arg) + " ";
+    }
+    if (!output) {
+        return system(command.c_str());
+    }
+    command += "2>&1";
+    FILE* pipe = _popen(command.c_str(), "r");
+    if (!pipe) {
+        return -1;
+    }
+    char buf[4096];
+    size_t n;
+    size_t dropped = 0;
+    while ((n = fread(buf, 1, sizeof(buf), pipe)) > 0) {
+        size_t keep = std::min(n, outputLimit - std::min(outputLimit, output->size()));
+        output->append(buf, keep);
+        dropped += n - keep;
+    }
+    if (dropped) {
+        *output += "\n[Dragon] Output truncated, " + std::to_string(dropped) + " bytes dropped\n";
+    }
+    return _pclose(pipe);
+#endif
+}
+
+int run_command(const std::string& command) {
+#if !defined(_WIN32)
+    if (strstarts(command, SHELL_PREFIX)) {
+        return spawn_process({"/bin/sh", "-c", command.substr(strlen(SHELL_PREFIX))});
+    }
+    if (command.find_first_of("|&;<>*?`$(){}~") != std::string::npos) {
+        DRAGON_ERR << "Warning: '" << command << "' is not run through a shell, prefix it with '" SHELL_PREFIX "' to use shell syntax" << std::endl;
+    }
+    return spawn_process(split_command_line(command));
+#else
+    if (strstarts(command, SHELL_PREFIX)) {
+        return system(command.substr(strlen(SHELL_PREFIX)).c_str());
+    }
+    return system(command.c_str());
+#endif
+}
+
+void emit_job_output(const std::string& log, const std::string& diagnostics) {
+    static std::mutex outputLock;
+    std::lock_guard<std::mutex> guard(outputLock);
+    if (diagnostics.size()) {
+        std::cout.flush();
+        std::cerr.write(diagnostics.data(), diagnostics.size());
+        if (diagnostics.back() != '\n') {
+            std::cerr.put('\n');
+        }
+        std::cerr.flush();
+    }
+    if (log.size()) {
+        std::cout.write(log.data(), log.size());
+        std::cout.flush();
+    }
+}
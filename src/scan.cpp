@@ -0,0 +1,243 @@
+#include "dragon.hpp"
+
+static void scan_subtree(const std::string& dir, JobPool& pool, const std::function<bool(const std::string& dir)>& prune, const std::function<void(const std::string& file)>& visit) {
+    std::error_code ec;
+    for (auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+        std::string path = entry.path().string();
+        if (entry.is_directory(ec) && !entry.is_symlink(ec)) {
+            if (!prune(path)) {
+                // subdirectories are scanned by whichever worker is free,
+                // pruned ones are never opened
+                pool.submit([path, &pool, &prune, &visit](size_t) {
+                    scan_subtree(path, pool, prune, visit);
+                });
+            }
+        } else if (entry.is_regular_file(ec)) {
+            visit(path);
+        }
+    }
+}
+
+void scan_directory(const std::string& root, JobPool& pool, const std::function<bool(const std::string& dir)>& prune, const std::function<void(const std::string& file)>& visit) {
+    pool.submit([&](size_t) {
+        scan_subtree(root, pool, prune, visit);
+    });
+    pool.wait();
+}
+
+static bool glob_match_at(const char* p, const char* s) {
+    while (*p) {
+        if (p[0] == '*' && p[1] == '*') {
+            p += 2;
+            if (*p == '/') {
+                // "**/" matches zero or more whole directories
+                p++;
+                for (const char* t = s; ; t++) {
+                    if (glob_match_at(p, t)) {
+                        return true;
+                    }
+                    t = strchr(t, '/');
+                    if (!t) {
+                        return false;
+                    }
+                }
+            }
+            for (const char* t = s; ; t++) {
+                if (glob_match_at(p, t)) {
+                    return true;
+                }
+                if (!*t) {
+                    return false;
+                }
+            }
+        }
+        if (*p == '*') {
+            p++;
+            for (const char* t = s; ; t++) {
+                if (glob_match_at(p, t)) {
+                    return true;
+                }
+                if (!*t || *t == '/') {
+                    return false;
+                }
+            }
+        }
+        if (!*s) {
+            return false;
+        }
+        if (*p == '?') {
+            if (*s == '/') {
+                return false;
+            }
+            p++;
+            s++;
+            continue;
+        }
+        if (*p == '[' && strchr(p + 1, ']')) {
+            const char* c = p + 1;
+            bool negate = *c == '!' || *c == '^';
+            if (negate) {
+                c++;
+            }
+            bool matched = false;
+            // a ']' right after the opening bracket is part of the class
+            do {
+                if (c[1] == '-' && c[2] && c[2] != ']') {
+                    matched |= *s >= c[0] && *s <= c[2];
+                    c += 3;
+                } else {
+                    matched |= *s == *c;
+                    c++;
+                }
+            } while (*c && *c != ']');
+            if (!*c || matched == negate || *s == '/') {
+                return false;
+            }
+            p = c + 1;
+            s++;
+            continue;
+        }
+        if (*p != *s) {
+            return false;
+        }
+        p++;
+        s++;
+    }
+    return !*s;
+}
+
+bool glob_match(const std::string& pattern, const std::string& path) {
+    return glob_match_at(pattern.c_str(), path.c_str());
+}
+
+bool is_glob(const std::string& pattern) {
+    return pattern.find_first_of("*?[") != std::string::npos || strstarts(pattern, "!");
+}
+
+// One record per directory, followed by its entries:
+//   dir  <mtime> <path relative to the root>
+//   file <name>
+//   sub  <name>
+bool DirectorySnapshot::load(const std::string& path) {
+    std::ifstream file(path);
+    if (!file) {
+        return false;
+    }
+    std::string line;
+    if (!std::getline(file, line) || !strstarts(line, "root\t")) {
+        return false;
+    }
+    this->root = line.substr(5);
+    Dir* current = nullptr;
+    while (std::getline(file, line)) {
+        size_t tab = line.find('\t');
+        if (tab == std::string::npos) {
+            continue;
+        }
+        std::string kind = line.substr(0, tab);
+        std::string value = line.substr(tab + 1);
+        if (kind == "dir") {
+            size_t second = value.find('\t');
+            if (second == std::string::npos) {
+                current = nullptr;
+                continue;
+            }
+            current = &this->dirs[value.substr(second + 1)];
+            current->mtime = std::strtoll(value.substr(0, second).c_str(), nullptr, 10);
+        } else if (current && kind == "file") {
+            current->files.push_back(value);
+        } else if (current && kind == "sub") {
+            current->subdirs.push_back(value);
+        }
+    }
+    return true;
+}
+
+bool DirectorySnapshot::save(const std::string& path) {
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream file(tmp);
+        if (!file) {
+            return false;
+        }
+        file << "root\t" << this->root << "\n";
+        for (auto&& dir : this->dirs) {
+            file << "dir\t" << dir.second.mtime << "\t" << dir.first << "\n";
+            for (auto&& name : dir.second.files) {
+                file << "file\t" << name << "\n";
+            }
+            for (auto&& name : dir.second.subdirs) {
+                file << "sub\t" << name << "\n";
+            }
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp, path, ec);
+    return !ec;
+}
+
+size_t DirectorySnapshot::refresh(const std::string& root, JobPool& pool, const std::function<bool(const std::string& dir)>& prune) {
+    if (this->root != root) {
+        this->dirs.clear();
+        this->root = root;
+    }
+    std::map<std::string, Dir> fresh;
+    std::mutex freshLock;
+    std::atomic<size_t> relisted{0};
+
+    std::function<void(const std::string&)> visitDir = [&](const std::string& rel) {
+        std::string path = rel.empty() ? root : root + std::filesystem::path::preferred_separator + rel;
+        std::error_code ec;
+        Dir dir;
+        dir.mtime = std::filesystem::last_write_time(path, ec).time_since_epoch().count();
+        if (ec) {
+            return;
+        }
+        // a directory's mtime only changes when entries are added, removed or
+        // renamed in it, so an unchanged one is not listed again
+        auto cached = this->dirs.find(rel);
+        if (cached != this->dirs.end() && cached->second.mtime == dir.mtime) {
+            dir.files = cached->second.files;
+            dir.subdirs = cached->second.subdirs;
+        } else {
+            relisted++;
+            for (auto& entry : std::filesystem::directory_iterator(path, ec)) {
+                std::string name = entry.path().filename().string();
+                if (entry.is_directory(ec) && !entry.is_symlink(ec)) {
+                    dir.subdirs.push_back(name);
+                } else if (entry.is_regular_file(ec)) {
+                    dir.files.push_back(name);
+                }
+            }
+        }
+        for (auto&& name : dir.subdirs) {
+            std::string sub = rel.empty() ? name : rel + "/" + name;
+            if (prune(root + std::filesystem::path::preferred_separator + sub)) {
+                continue;
+            }
+            pool.submit([sub, &visitDir](size_t) {
+                visitDir(sub);
+            });
+        }
+        std::lock_guard<std::mutex> guard(freshLock);
+        fresh[rel] = std::move(dir);
+    };
+    pool.submit([&](size_t) {
+        visitDir("");
+    });
+    pool.wait();
+
+    this->dirs = std::move(fresh);
+    return relisted;
+}
+
+std::vector<std::string> DirectorySnapshot::files() {
+    std::vector<std::string> files;
+    for (auto&& dir : this->dirs) {
+        for (auto&& name : dir.second.files) {
+            files.push_back(dir.first.empty() ? name : dir.first + "/" + name);
+        }
+    }
+    std::sort(files.begin(), files.end());
+    return files;
+}
@@ -0,0 +1,306 @@
+#include "dragon.hpp"
+
+// Keys of the enclosing config that are not passed on to its targets,
+// each target gets its own output directory below the enclosing one
+static bool inherited_key(const std::string& key) {
+    return key != "targets" && key != "units" && key != "target" && key != "type" && key != "deps" &&
+           key != "outputDir" && key != PRE_BUILD_TAG && key != POST_BUILD_TAG;
+}
+
+static std::string library_file(const std::string& name, const std::string& type) {
+#if defined(_WIN32)
+    return name + (type == "static" ? ".lib" : ".dll");
+#elif defined(__APPLE__)
+    return "lib" + name + (type == "static" ? ".a" : ".dylib");
+#else
+    return "lib" + name + (type == "static" ? ".a" : ".so");
+#endif
+}
+
+static bool run_build_commands(DragonConfig::CompoundEntry* buildConfig, const std::string& tag) {
+    DragonConfig::ListEntry* commands = buildConfig->getList(tag);
+    if (!commands) {
+        return true;
+    }
+    for (u_long i = 0; i < commands->size(); i++) {
+        DRAGON_LOG << "Running " << tag << " command: " << commands->getString(i)->getValue() << std::endl;
+        TraceSpan span(tag, "command");
+        span.arg("command", commands->getString(i)->getValue());
+        int ret = run_command(commands->getString(i)->getValue());
+        span.arg("exit status", std::to_string(ret));
+        if (ret != 0) {
+            DRAGON_ERR << "Command failed: " << commands->getString(i)->getValue() << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+void BuildTarget::waitForTurn() {
+    std::unique_lock<std::mutex> lock(this->graph->lock);
+    this->graph->changed.wait(lock, [this]() { return this->graph->turn == this->index; });
+}
+
+void BuildTarget::finishTurn() {
+    std::lock_guard<std::mutex> guard(this->graph->lock);
+    this->graph->turn++;
+    this->graph->changed.notify_all();
+}
+
+bool BuildTarget::waitForDeps() {
+    std::unique_lock<std::mutex> lock(this->graph->lock);
+    this->graph->changed.wait(lock, [this]() {
+        for (auto&& dep : this->deps) {
+            if (!dep->finished) {
+                return false;
+            }
+        }
+        return true;
+    });
+    for (auto&& dep : this->deps) {
+        if (dep->output.empty()) {
+            DRAGON_ERR << "Not linking " << this->name << ", dependency " << dep->name << " failed" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+std::vector<BuildTarget*> BuildTarget::libraries() {
+    // static libraries need the libraries they use after them on the link line
+    std::vector<BuildTarget*> libs;
+    std::vector<BuildTarget*> pending(this->deps);
+    while (pending.size()) {
+        BuildTarget* dep = pending.front();
+        pending.erase(pending.begin());
+        if (dep->type == "exe") {
+            continue;
+        }
+        libs.erase(std::remove(libs.begin(), libs.end(), dep), libs.end());
+        libs.push_back(dep);
+        pending.insert(pending.end(), dep->deps.begin(), dep->deps.end());
+    }
+    return libs;
+}
+
+bool BuildTarget::linkedIntoShared() {
+    for (auto&& target : this->graph->targets) {
+        if (target.second.type != "shared") {
+            continue;
+        }
+        std::vector<BuildTarget*> libs = target.second.libraries();
+        if (std::find(libs.begin(), libs.end(), this) != libs.end()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+TargetTurn::TargetTurn(BuildTarget* target) : target(target) {
+    if (this->target) {
+        this->target->waitForTurn();
+    }
+}
+
+TargetTurn::~TargetTurn() {
+    this->release();
+}
+
+void TargetTurn::release() {
+    if (this->target) {
+        this->target->finishTurn();
+        this->target = nullptr;
+    }
+}
+
+bool TargetGraph::claim(const std::string& outFile, const std::function<void(int exitStatus, const BuildRecord& record)>& waiter) {
+    std::unique_lock<std::mutex> lock(this->lock);
+    auto existing = this->objects.find(outFile);
+    if (existing == this->objects.end()) {
+        this->objects[outFile];
+        return true;
+    }
+    if (!existing->second.done) {
+        existing->second.waiters.push_back(waiter);
+        return false;
+    }
+    int exitStatus = existing->second.exitStatus;
+    BuildRecord record = existing->second.record;
+    lock.unlock();
+    waiter(exitStatus, record);
+    return false;
+}
+
+void TargetGraph::publish(const std::string& outFile, int exitStatus, const BuildRecord& record) {
+    std::vector<std::function<void(int exitStatus, const BuildRecord& record)>> waiters;
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        SharedObject& object = this->objects[outFile];
+        object.done = true;
+        object.exitStatus = exitStatus;
+        object.record = record;
+        waiters.swap(object.waiters);
+    }
+    for (auto&& waiter : waiters) {
+        waiter(exitStatus, record);
+    }
+}
+
+std::string build_targets(DragonConfig::CompoundEntry* buildConfig) {
+    DragonConfig::CompoundEntry* section = buildConfig->getCompound("targets");
+    if (overrideOutputDir) {
+        buildConfig->setString("outputDir", outputDir);
+    }
+    std::string outDir = buildConfig->getStringOrDefault("outputDir", "build")->getValue();
+
+    TargetGraph graph;
+    std::vector<BuildTarget*> declared;
+    for (auto&& entry : section->entries) {
+        if (entry->getType() != DragonConfig::EntryType::Compound) {
+            DRAGON_ERR << "Target '" << entry->getKey() << "' is not a compound" << std::endl;
+            return "";
+        }
+        DragonConfig::CompoundEntry* targetConfig = reinterpret_cast<DragonConfig::CompoundEntry*>(entry);
+        BuildTarget& target = graph.targets[entry->getKey()];
+        target.name = entry->getKey();
+        target.graph = &graph;
+        target.type = targetConfig->getStringOrDefault("type", "exe")->getValue();
+        if (target.type != "exe" && target.type != "static" && target.type != "shared") {
+            DRAGON_ERR << "Unknown type '" << target.type << "' for target '" << target.name << "'" << std::endl;
+            return "";
+        }
+
+        // a target sees the keys of the enclosing config it does not set itself
+        target.config = new DragonConfig::CompoundEntry();
+        for (auto&& inherited : buildConfig->entries) {
+            if (inherited_key(inherited->getKey()) && !targetConfig->hasMember(inherited->getKey())) {
+                target.config->entries.push_back(inherited);
+            }
+        }
+        for (auto&& own : targetConfig->entries) {
+            target.config->entries.push_back(own);
+        }
+        if (!targetConfig->hasMember("outputDir")) {
+            target.config->setString("outputDir", outDir + std::filesystem::path::preferred_separator + target.name);
+        }
+        if (!targetConfig->hasMember("target")) {
+            target.config->setString("target", target.type == "exe" ? target.name : library_file(target.name, target.type));
+        }
+        target.config->setString("type", target.type);
+        declared.push_back(&target);
+    }
+    if (declared.empty()) {
+        DRAGON_ERR << "No targets defined!" << std::endl;
+        return "";
+    }
+
+    for (auto&& target : declared) {
+        DragonConfig::ListEntry* deps = target->config->getList("deps");
+        for (u_long i = 0; deps && i < deps->size(); i++) {
+            auto dep = graph.targets.find(deps->getString(i)->getValue());
+            if (dep == graph.targets.end()) {
+                DRAGON_ERR << "Target '" << target->name << "' depends on unknown target '" << deps->getString(i)->getValue() << "'" << std::endl;
+                return "";
+            }
+            target->deps.push_back(&dep->second);
+        }
+    }
+
+    // dependencies come before their dependents, in declaration order otherwise
+    std::vector<BuildTarget*> order;
+    std::map<BuildTarget*, int> visited;
+    std::function<bool(BuildTarget*)> visit = [&](BuildTarget* target) {
+        if (visited[target] == 2) {
+            return true;
+        }
+        if (visited[target] == 1) {
+            DRAGON_ERR << "Dependency cycle through target '" << target->name << "'" << std::endl;
+            return false;
+        }
+        visited[target] = 1;
+        for (auto&& dep : target->deps) {
+            if (!visit(dep)) {
+                return false;
+            }
+        }
+        visited[target] = 2;
+        target->index = order.size();
+        order.push_back(target);
+        return true;
+    };
+    for (auto&& target : declared) {
+        if (!visit(target)) {
+            return "";
+        }
+    }
+
+    graph.objectDir = outDir + std::filesystem::path::preferred_separator + "objects";
+    try {
+        std::filesystem::create_directories(graph.objectDir);
+    } catch (std::filesystem::filesystem_error& e) {
+        DRAGON_ERR << "Failed to create output directory: " << graph.objectDir << std::endl;
+        return "";
+    }
+
+    if (!run_build_commands(buildConfig, PRE_BUILD_TAG)) {
+        return "";
+    }
+
+    bool parallelBuild = parallel && buildConfig->getStringOrDefault("parallelBuild", "false")->getValue() == "true";
+    size_t maxJobs = jobs ? jobs : default_job_count();
+    bool adaptive = parallelBuild && buildConfig->getStringOrDefault("adaptiveJobs", "false")->getValue() == "true";
+    if (adaptive) {
+        maxJobs = std::strtoul(buildConfig->getStringOrDefault("maxJobs", std::to_string(maxJobs))->getValue().c_str(), nullptr, 10);
+    }
+    uint64_t memoryLimit = memoryBudget ? memoryBudget : parse_size(buildConfig->getStringOrDefault("maxBuildMemory", "0")->getValue());
+    JobPool pool(parallelBuild ? maxJobs : 1, memoryLimit);
+    std::unique_ptr<LoadMonitor> monitor;
+    if (adaptive) {
+        size_t minJobs = std::strtoul(buildConfig->getStringOrDefault("minJobs", "1")->getValue().c_str(), nullptr, 10);
+        monitor = std::make_unique<LoadMonitor>(pool, minJobs, pool.size());
+    }
+    for (size_t i = 0; i < pool.size(); i++) {
+        trace_name_track(i + 1, "worker " + std::to_string(i + 1));
+    }
+    graph.pool = &pool;
+
+    DRAGON_LOG << "Building " << order.size() << " target(s) with " << pool.size() << " job(s)" << std::endl;
+    std::vector<std::thread> threads;
+    for (auto&& target : order) {
+        threads.emplace_back([target]() {
+            std::string output;
+            {
+                TraceSpan span(target->name, "target");
+                output = build_from_config(target->config, nullptr, target);
+            }
+            std::lock_guard<std::mutex> guard(target->graph->lock);
+            target->output = output;
+            target->finished = true;
+            target->graph->changed.notify_all();
+        });
+    }
+    for (auto&& thread : threads) {
+        thread.join();
+    }
+    monitor.reset();
+
+    std::string result;
+    bool failed = false;
+    for (auto&& target : declared) {
+        if (target->output.empty()) {
+            DRAGON_ERR << "Target '" << target->name << "' failed" << std::endl;
+            failed = true;
+        } else if (result.empty() && target->type == "exe") {
+            result = target->output;
+        }
+    }
+    if (failed) {
+        DRAGON_ERR << "Build failed!" << std::endl;
+        return "";
+    }
+    if (!run_build_commands(buildConfig, POST_BUILD_TAG)) {
+        return "";
+    }
+    // 'dragon run' runs the first executable target
+    return result.size() ? result : declared.front()->output;
+}
@@ -0,0 +1,143 @@
+#include "dragon.hpp"
+
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// split up so that this file does not report itself
+static const char todoMarker[] = "// " "TODO";
+#define TODO_MARKER_LEN (sizeof(todoMarker) - 1)
+
+static const char* find_marker(const char* data, size_t size) {
+#if defined(_WIN32)
+    const char* hit = std::search(data, data + size, todoMarker, todoMarker + TODO_MARKER_LEN);
+    return hit == data + size ? nullptr : hit;
+#else
+    // glibc's memmem uses a vectorised two-way search
+    return (const char*) memmem(data, size, todoMarker, TODO_MARKER_LEN);
+#endif
+}
+
+static void find_todos(const char* data, size_t size, std::vector<std::string>& todos) {
+    const char* end = data + size;
+    const char* p = data;
+    const char* hit;
+    while (p < end && (hit = find_marker(p, end - p))) {
+        const char* text = hit + TODO_MARKER_LEN;
+        // skip the separator, usually ':' or ' '
+        if (text < end && *text != '\n') {
+            text++;
+        }
+        const char* eol = (const char*) memchr(text, '\n', end - text);
+        if (!eol) {
+            eol = end;
+        }
+        std::string todo(text, eol);
+        if (todo.size() && todo.back() == '\r') {
+            todo.pop_back();
+        }
+        todos.push_back(todo);
+        // only the first marker on a line counts
+        p = eol;
+    }
+}
+
+bool scan_todos(const std::string& path, std::vector<std::string>& todos) {
+#if defined(_WIN32)
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    find_todos(data.data(), data.size(), todos);
+    return true;
+#else
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return true;
+    }
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    find_todos((const char*) data, st.st_size, todos);
+    munmap(data, st.st_size);
+    return true;
+#endif
+}
+
+// One record per scanned file content, followed by its todos:
+//   file <digest>
+//   todo <text>
+bool TodoCache::load(const std::string& path) {
+    std::ifstream file(path);
+    if (!file) {
+        return false;
+    }
+    std::string line;
+    std::vector<std::string>* current = nullptr;
+    while (std::getline(file, line)) {
+        if (strstarts(line, "file\t")) {
+            current = &this->files[std::strtoull(line.c_str() + 5, nullptr, 16)];
+        } else if (current && strstarts(line, "todo\t")) {
+            current->push_back(line.substr(5));
+        }
+    }
+    return true;
+}
+
+bool TodoCache::save(const std::string& path) {
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream file(tmp);
+        if (!file) {
+            return false;
+        }
+        // contents no unit has anymore are dropped
+        for (auto&& digest : this->used) {
+            file << "file\t" << hash_to_string(digest) << "\n";
+            for (auto&& todo : this->files[digest]) {
+                file << "todo\t" << todo << "\n";
+            }
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp, path, ec);
+    return !ec;
+}
+
+bool TodoCache::scan(const std::string& path, FileHashCache& hashes, std::vector<std::string>& todos) {
+    uint64_t digest;
+    if (!hashes.digest(path, digest)) {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> guard(this->lock);
+        this->used.insert(digest);
+        auto cached = this->files.find(digest);
+        if (cached != this->files.end()) {
+            todos = cached->second;
+            return true;
+        }
+    }
+    if (!scan_todos(path, todos)) {
+        return false;
+    }
+    std::lock_guard<std::mutex> guard(this->lock);
+    this->files[digest] = todos;
+    this->dirty = true;
+    return true;
+}
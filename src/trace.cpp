@@ -0,0 +1,126 @@
+#include "dragon.hpp"
+
+// Chrome trace event format, loadable in chrome://tracing and ui.perfetto.dev
+// https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU
+
+struct TraceEvent {
+    std::string name;
+    std::string category;
+    uint64_t start;
+    uint64_t duration;
+    size_t track;
+    std::vector<std::pair<std::string, std::string>> args;
+};
+
+static std::string traceFile;
+static std::chrono::steady_clock::time_point traceStart;
+static std::mutex traceLock;
+static std::vector<TraceEvent> traceEvents;
+static std::map<size_t, std::string> traceTracks;
+
+static uint64_t trace_now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - traceStart).count();
+}
+
+static std::string json_escape(const std::string& str) {
+    std::string out;
+    out.reserve(str.size());
+    for (char c : str) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if ((unsigned char) c < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    out += buf;
+                } else {
+                    out += c;
+                }
+        }
+    }
+    return out;
+}
+
+void trace_start(const std::string& file) {
+    traceFile = file;
+    traceStart = std::chrono::steady_clock::now();
+    trace_name_track(0, "main");
+}
+
+bool trace_enabled() {
+    return traceFile.size();
+}
+
+void trace_name_track(size_t track, const std::string& name) {
+    if (!trace_enabled()) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(traceLock);
+    traceTracks[track] = name;
+}
+
+TraceSpan::TraceSpan(const std::string& name, const std::string& category, size_t track)
+    : name(name), category(category), track(track) {
+    if (trace_enabled()) {
+        this->start = trace_now();
+    }
+}
+
+TraceSpan::~TraceSpan() {
+    this->end();
+}
+
+void TraceSpan::end() {
+    if (!trace_enabled() || this->ended) {
+        return;
+    }
+    this->ended = true;
+    uint64_t end = trace_now();
+    std::lock_guard<std::mutex> guard(traceLock);
+    traceEvents.push_back(TraceEvent{this->name, this->category, this->start, end - this->start, this->track, this->args});
+}
+
+void TraceSpan::arg(const std::string& key, const std::string& value) {
+    if (trace_enabled()) {
+        this->args.emplace_back(key, value);
+    }
+}
+
+void trace_write() {
+    if (!trace_enabled()) {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(traceLock);
+    std::ofstream out(traceFile);
+    if (!out) {
+        DRAGON_ERR << "Failed to write trace file: " << traceFile << std::endl;
+        return;
+    }
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"dragon\"}}";
+    for (auto&& track : traceTracks) {
+        out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << track.first
+            << ",\"args\":{\"name\":\"" << json_escape(track.second) << "\"}}";
+        out << ",\n{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":1,\"tid\":" << track.first
+            << ",\"args\":{\"sort_index\":" << track.first << "}}";
+    }
+    for (auto&& event : traceEvents) {
+        out << ",\n{\"name\":\"" << json_escape(event.name) << "\",\"cat\":\"" << json_escape(event.category)
+            << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.track
+            << ",\"ts\":" << event.start << ",\"dur\":" << event.duration;
+        if (event.args.size()) {
+            out << ",\"args\":{";
+            for (size_t i = 0; i < event.args.size(); i++) {
+                out << (i ? "," : "") << "\"" << json_escape(event.args[i].first) << "\":\"" << json_escape(event.args[i].second) << "\"";
+            }
+            out << "}";
+        }
+        out << "}";
+    }
+    out << "\n]}\n";
+    DRAGON_LOG << "Wrote trace to " << traceFile << std::endl;
+}